@@ -1,4 +1,5 @@
 #!/bin/sh
 
 compiler="${compiler-cc}"
-$compiler -O3 -I./ -Isrc/ -o myspotifypl src/main.c -lcurl
+cflags="${cflags-}"
+$compiler -O3 $cflags -I./ -Isrc/ -o myspotifypl src/main.c -lcurl
@@ -38,8 +38,8 @@ Buffer
 copyBuffer(MemoryArena *arena, Buffer buf)
 {
     Buffer newBuf = allocateBuffer(arena, buf.count);
-    for(u64 i = 0; i < buf.count; ++i) {
-        newBuf.data[i] = buf.data[i];
+    if(newBuf.data && buf.count) {
+        memcpy(newBuf.data, buf.data, buf.count);
     }
     return newBuf;
 }
@@ -82,6 +82,7 @@ dumpFileIntoBuffer(MemoryArena *arena, char const *filePath)
     if(buf.data) {
         fread(buf.data, sizeof(u8), fileSize, file);
     }
+    fclose(file);
     return buf;
 }
 
@@ -90,8 +91,8 @@ pushBuffer(MemoryArena *arena, Buffer buf)
 {
     Buffer newBuf = {.count = buf.count};
     newBuf.data = pushToMemoryArena(arena, newBuf.count); 
-    for(u64 i = 0; i < buf.count; ++i) {
-        newBuf.data[i] = buf.data[i];
+    if(newBuf.data && buf.count) {
+        memcpy(newBuf.data, buf.data, buf.count);
     }
     return newBuf;
 }
@@ -7,20 +7,86 @@ typedef enum json_ElementType {
     json_FALSE,
     json_NULL,
     json_STRING,
+    // only found inside tapes, it's the label of the object member that
+    // comes right after it
+    json_LABEL,
+    // only found inside tapes, right after each object entry
+    json_OBJECT_INDEX,
+    // only found inside tapes, right after each number entry
+    json_NUMBER_VALUE,
 } json_ElementType;
 
+// Parsed documents are stored as a tape: a flat array of entries in the same
+// order as the text. A list is an entry followed by the entries of its
+// contents, and each member of an object is a json_LABEL entry followed by
+// the member's value. A list entry knows how many entries it spans, so
+// skipping it is a single jump.
+//
+// Object entries are always followed by a json_OBJECT_INDEX entry. For
+// objects with many members it points to a hash table of the members' labels,
+// which makes json_getElementByKey a constant time lookup.
+//
+// Number entries are always followed by a json_NUMBER_VALUE entry, holding the
+// number already converted when it was parsed.
+typedef struct json_TapeEntry {
+    u8 type;
+    // number values only, set when the number fits in integer
+    u8 isInteger;
+    // labels only, see json_makeKey
+    u16 hash;
+    // length of strings, numbers and labels, item count of lists, slot count
+    // of object indexes
+    u32 count;
+    union {
+        // strings, numbers, labels and object indexes
+        u8 *data;
+        // lists, counting the list entry itself
+        u64 span;
+        // number values
+        s64 integer;
+        f64 real;
+    };
+} json_TapeEntry;
+
+// A label together with its hash, so it can be hashed once and used for many
+// lookups
+typedef struct json_Key {
+    Buffer label;
+    u16 hash;
+} json_Key;
+
+// objects with fewer members than this are searched linearly
+#define JSON_OBJECT_INDEX_MIN_COUNT 8
+
+// Documents with lists nested deeper than this are rejected by the parsers,
+// it can be changed at build time
+#ifndef JSON_MAX_DEPTH
+#define JSON_MAX_DEPTH 64
+#endif
+
+// View of one element of a tape. Walk through lists with
+// json_getFirstSubElement and json_getNextSibling.
 typedef struct json_Element {
     json_ElementType type;
     Buffer label;
     Buffer value;
-    struct json_Element *firstSubElement;
-    struct json_Element *nextSibling;
+    json_TapeEntry const *entry;
+    // end of the list that contains the element
+    json_TapeEntry const *listEnd;
 } json_Element;
 
 typedef struct Cursor {
     Buffer buf;
     u64 offset;
     b32 errorOccurred;
+    u32 const *structurals;
+    u64 structuralCount;
+    u64 nextStructural;
+    // values and labels point into buf instead of being copied
+    b32 inPlace;
+    json_TapeEntry *tape;
+    u64 tapeCount;
+    u64 tapeMaxCount;
 } Cursor;
 
 typedef enum TokenType {
@@ -55,10 +121,13 @@ parsingError(Cursor *cur, char const *message)
     cur->errorOccurred = 1;
 }
 
+// Past the end of the text it reads as '\0', a streamed number sits at the top
+// of its arena and the byte after it may be garbage
 static char
 peek(Cursor const *cur)
 {
-    return (char)cur->buf.data[cur->offset];
+    return isInBounds(cur->buf, cur->offset) ?
+        (char)cur->buf.data[cur->offset] : '\0';
 }
 
 static b32
@@ -97,39 +166,289 @@ isNumeric(char ch)
     return ch >= '0' && ch <= '9';
 }
 
-static void
-skipSpaces(Cursor *cur)
+// Structural index
+//
+// Before parsing, the whole text goes through a vectorized pass that finds
+// where every token starts: the characters {}[]:, outside of strings, the
+// opening quote of every string and the first character of every number or
+// keyword. The tokenizer then jumps from one offset to the next instead of
+// walking the text one byte at a time. Blocks of 64 bytes are classified into
+// bitmasks (one bit per byte) and the string/escape bookkeeping is done with
+// plain integer operations on those masks.
+//
+// The vector code is AVX2 when the compiler targets it and SSE2 otherwise.
+// Build with -DJSON_SIMD=0 to use the table-driven scalar code instead.
+
+#define STRUCTURAL_BLOCK_SIZE 64
+
+#ifndef JSON_SIMD
+#define JSON_SIMD 1
+#endif
+
+#if JSON_SIMD && defined(__AVX2__)
+#include <immintrin.h>
+
+typedef __m256i Vector;
+#define VECTOR_SIZE 32
+
+static Vector loadVector(u8 const *data)
+{ return _mm256_loadu_si256((__m256i const*)data); }
+static Vector vectorEquals(Vector v, char ch)
+{ return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(ch)); }
+static Vector vectorOr(Vector a, Vector b)
+{ return _mm256_or_si256(a, b); }
+static u64 vectorToMask(Vector v)
+{ return (u32)_mm256_movemask_epi8(v); }
+
+#elif JSON_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+
+typedef __m128i Vector;
+#define VECTOR_SIZE 16
+
+static Vector loadVector(u8 const *data)
+{ return _mm_loadu_si128((__m128i const*)data); }
+static Vector vectorEquals(Vector v, char ch)
+{ return _mm_cmpeq_epi8(v, _mm_set1_epi8(ch)); }
+static Vector vectorOr(Vector a, Vector b)
+{ return _mm_or_si128(a, b); }
+static u64 vectorToMask(Vector v)
+{ return (u16)_mm_movemask_epi8(v); }
+
+#endif
+
+typedef struct BlockMasks {
+    u64 quote;
+    u64 backslash;
+    u64 op;
+    u64 space;
+} BlockMasks;
+
+typedef struct json_StructuralIndex {
+    u32 *offsets;
+    u64 count;
+} json_StructuralIndex;
+
+#if defined(VECTOR_SIZE)
+
+static BlockMasks
+classifyBlock(u8 const *block)
 {
-    if(isCursorEnd(cur)) {
-        return;
+    BlockMasks masks = {0};
+    for(u64 i = 0; i < STRUCTURAL_BLOCK_SIZE; i += VECTOR_SIZE) {
+        Vector v = loadVector(block + i);
+        Vector op =
+            vectorOr(vectorOr(vectorEquals(v, '{'), vectorEquals(v, '}')),
+                    vectorOr(vectorEquals(v, '['), vectorEquals(v, ']')));
+        op = vectorOr(op, vectorOr(vectorEquals(v, ':'), vectorEquals(v, ',')));
+        // '\0' counts as space, the tokenizer treats it as the end of the text
+        Vector space =
+            vectorOr(vectorOr(vectorEquals(v, ' '), vectorEquals(v, '\t')),
+                    vectorOr(vectorEquals(v, '\n'), vectorEquals(v, '\r')));
+        space = vectorOr(space,
+                vectorOr(vectorEquals(v, '\v'), vectorEquals(v, '\0')));
+        masks.quote     |= vectorToMask(vectorEquals(v, '"')) << i;
+        masks.backslash |= vectorToMask(vectorEquals(v, '\\')) << i;
+        masks.op        |= vectorToMask(op) << i;
+        masks.space     |= vectorToMask(space) << i;
     }
-    char ch = peek(cur);
-    while((isSpace(ch) || !ch) && !isCursorEnd(cur)) {
-        cur->offset += 1;
-        ch = peek(cur);
+    return masks;
+}
+
+#else
+
+enum {
+    CHAR_QUOTE = 1,
+    CHAR_BACKSLASH = 2,
+    CHAR_OP = 4,
+    CHAR_SPACE = 8,
+};
+
+static u8 const characterClassTable[256] = {
+    ['"'] = CHAR_QUOTE, ['\\'] = CHAR_BACKSLASH,
+    ['{'] = CHAR_OP, ['}'] = CHAR_OP, ['['] = CHAR_OP, [']'] = CHAR_OP,
+    [':'] = CHAR_OP, [','] = CHAR_OP,
+    [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE,
+    ['\r'] = CHAR_SPACE, ['\v'] = CHAR_SPACE, ['\0'] = CHAR_SPACE,
+};
+
+static BlockMasks
+classifyBlock(u8 const *block)
+{
+    BlockMasks masks = {0};
+    for(u64 i = 0; i < STRUCTURAL_BLOCK_SIZE; ++i) {
+        u8 class = characterClassTable[block[i]];
+        masks.quote     |= (u64)((class & CHAR_QUOTE) != 0) << i;
+        masks.backslash |= (u64)((class & CHAR_BACKSLASH) != 0) << i;
+        masks.op        |= (u64)((class & CHAR_OP) != 0) << i;
+        masks.space     |= (u64)((class & CHAR_SPACE) != 0) << i;
+    }
+    return masks;
+}
+
+#endif
+
+// Returns the offset of the first '"' or '\\' in data, or count if there's
+// none.
+static u64
+findQuoteOrBackslash(u8 const *data, u64 count)
+{
+    u64 i = 0;
+#if defined(VECTOR_SIZE)
+    for(; i + VECTOR_SIZE <= count; i += VECTOR_SIZE) {
+        Vector v = loadVector(data + i);
+        u64 mask = vectorToMask(
+                vectorOr(vectorEquals(v, '"'), vectorEquals(v, '\\')));
+        if(mask) {
+            return i + __builtin_ctzll(mask);
+        }
+    }
+#endif
+    for(; i < count; ++i) {
+        if(data[i] == '"' || data[i] == '\\') {
+            break;
+        }
+    }
+    return i;
+}
+
+// Returns the offset of the first '"', '{', '}', '[' or ']' in data, or count
+// if there's none.
+static u64
+findQuoteOrBracket(u8 const *data, u64 count)
+{
+    u64 i = 0;
+#if defined(VECTOR_SIZE)
+    for(; i + VECTOR_SIZE <= count; i += VECTOR_SIZE) {
+        Vector v = loadVector(data + i);
+        Vector bracket =
+            vectorOr(vectorOr(vectorEquals(v, '{'), vectorEquals(v, '}')),
+                    vectorOr(vectorEquals(v, '['), vectorEquals(v, ']')));
+        u64 mask = vectorToMask(vectorOr(bracket, vectorEquals(v, '"')));
+        if(mask) {
+            return i + __builtin_ctzll(mask);
+        }
+    }
+#endif
+    for(; i < count; ++i) {
+        u8 ch = data[i];
+        if(ch == '"' || ch == '{' || ch == '}' || ch == '[' || ch == ']') {
+            break;
+        }
+    }
+    return i;
+}
+
+// Returns the mask of characters escaped by an odd-length run of backslashes.
+// `prevEndsOddBackslash` carries a run that crosses the block boundary.
+static u64
+findEscapedCharacters(u64 backslash, u64 *prevEndsOddBackslash)
+{
+    u64 const evenBits = 0x5555555555555555ull;
+    u64 const oddBits = ~evenBits;
+    u64 startEdges = backslash & ~(backslash << 1);
+    u64 evenStartMask = evenBits ^ *prevEndsOddBackslash;
+    u64 evenStarts = startEdges & evenStartMask;
+    u64 oddStarts = startEdges & ~evenStartMask;
+    u64 evenCarries = backslash + evenStarts;
+    u64 oddCarries = 0;
+    b32 endsOddBackslash =
+        __builtin_add_overflow(backslash, oddStarts, &oddCarries);
+    oddCarries |= *prevEndsOddBackslash;
+    *prevEndsOddBackslash = endsOddBackslash ? 1 : 0;
+    u64 evenCarryEnds = evenCarries & ~backslash;
+    u64 oddCarryEnds = oddCarries & ~backslash;
+    return (evenCarryEnds & oddBits) | (oddCarryEnds & evenBits);
+}
+
+// Bit i of the result is the xor of bits 0..i of the input, which turns the
+// mask of unescaped quotes into the mask of bytes inside strings.
+static u64
+prefixXor(u64 mask)
+{
+    mask ^= mask << 1;
+    mask ^= mask << 2;
+    mask ^= mask << 4;
+    mask ^= mask << 8;
+    mask ^= mask << 16;
+    mask ^= mask << 32;
+    return mask;
+}
+
+static json_StructuralIndex
+buildStructuralIndex(MemoryArena *arena, Buffer buf)
+{
+    check(buf.count < (1ull << 32) && "offsets are stored in 32 bits");
+    json_StructuralIndex index = {0};
+    // pushing zero elements just gives us the top of the arena, the offsets
+    // of each block are pushed right after the previous ones
+    index.offsets = pushArray(arena, 0, u32);
+    u64 prevEndsOddBackslash = 0;
+    u64 prevInString = 0;
+    u64 prevEndsSeparator = 1;
+    for(u64 base = 0; base < buf.count; base += STRUCTURAL_BLOCK_SIZE) {
+        u8 const *block = buf.data + base;
+        u8 lastBlock[STRUCTURAL_BLOCK_SIZE];
+        u64 remaining = buf.count - base;
+        if(remaining < STRUCTURAL_BLOCK_SIZE) {
+            memset(lastBlock, ' ', STRUCTURAL_BLOCK_SIZE);
+            memcpy(lastBlock, block, remaining);
+            block = lastBlock;
+        }
+        BlockMasks masks = classifyBlock(block);
+
+        u64 escaped =
+            findEscapedCharacters(masks.backslash, &prevEndsOddBackslash);
+        u64 quote = masks.quote & ~escaped;
+        u64 inString = prefixXor(quote) ^ prevInString;
+        prevInString = (u64)((s64)inString >> 63);
+
+        u64 op = masks.op & ~inString;
+        u64 separator = op | (masks.space & ~inString);
+        u64 afterSeparator = (separator << 1) | prevEndsSeparator;
+        prevEndsSeparator = separator >> 63;
+        u64 scalar = ~(masks.op | masks.space | quote) & ~inString;
+        // inString includes the opening quote but not the closing one
+        u64 structural = op | (quote & inString) | (scalar & afterSeparator);
+
+        u64 structuralCount = __builtin_popcountll(structural);
+        u32 *offsets = pushArray(arena, structuralCount, u32);
+        check(offsets);
+        while(structural) {
+            *offsets++ = (u32)(base + __builtin_ctzll(structural));
+            structural &= structural - 1;
+        }
+        index.count += structuralCount;
     }
+    return index;
 }
 
 static TokenType
 parseString(Cursor *cur)
 {
     // NOTE: this function lets strings occupy multiple lines, which isn't right
-    char ch = peek(cur);
-    check(ch == '"');
-    cur->offset += 1;
-    ch = peek(cur);
-    // NOTE: possible off-by-one kind of erro here, that's why we should allocate a bigger buffer than the actual file size
-    while(ch != '"' && !isCursorEnd(cur)) {
-        if(ch == '\\') {
-            cur->offset += 2;
-        }
-        else {
-            cur->offset += 1;
+    check(peek(cur) == '"');
+    u64 start = cur->offset;
+    // only spaces can come between the closing quote and the next token
+    u64 end = (cur->nextStructural < cur->structuralCount) ?
+        cur->structurals[cur->nextStructural] : cur->buf.count;
+    while(end > start + 1 && cur->buf.data[end - 1] != '"') {
+        end -= 1;
+    }
+    b32 closed = end > start + 1;
+    if(closed) {
+        // the quote we found might be an escaped one
+        u64 backslashCount = 0;
+        for(u64 i = end - 1; i - 1 > start; --i) {
+            if(cur->buf.data[i - 1] != '\\') {
+                break;
+            }
+            backslashCount += 1;
         }
-        ch = peek(cur);
+        closed = (backslashCount % 2 == 0);
     }
-    if(ch == '"') {
-        cur->offset += 1;
+    if(closed) {
+        cur->offset = end;
         return TK_STRING;
     }
     else {
@@ -206,10 +525,104 @@ parseNumber(Cursor *cur)
     return TK_NUMBER;
 }
 
+// every power of ten up to here is exactly representable as a f64
+static f64 const exactPowersOfTen[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Converts the text of a number that parseNumber accepted. Integers that fit
+// in a s64 are read exactly. Other numbers whose significant digits fit in a
+// f64 mantissa are one exact multiplication or division away from the
+// correctly rounded result, and the rare remaining ones go to strtod. The
+// arena is only used as scratch space.
+static json_TapeEntry
+parseNumberValue(MemoryArena *arena, Buffer text)
+{
+    json_TapeEntry value = {.type = json_NUMBER_VALUE};
+    u8 const *data = text.data;
+    u64 offset = 0;
+    b32 isNegative = (offset < text.count && data[offset] == '-');
+    offset += isNegative;
+
+    // the first 19 significant digits always fit in a u64
+    u64 mantissa = 0;
+    u64 significantDigitCount = 0;
+    b32 isTruncated = 0;
+    s64 exponent = 0;
+    for(; offset < text.count && isNumeric((char)data[offset]); ++offset) {
+        u64 digit = data[offset] - '0';
+        if(significantDigitCount < 19) {
+            mantissa = 10*mantissa + digit;
+            significantDigitCount += (mantissa != 0);
+        }
+        else {
+            exponent += 1;
+            isTruncated |= (digit != 0);
+        }
+    }
+    b32 isInteger = 1;
+    if(offset < text.count && data[offset] == '.') {
+        isInteger = 0;
+        offset += 1;
+        for(; offset < text.count && isNumeric((char)data[offset]); ++offset) {
+            u64 digit = data[offset] - '0';
+            if(significantDigitCount < 19) {
+                mantissa = 10*mantissa + digit;
+                significantDigitCount += (mantissa != 0);
+                exponent -= 1;
+            }
+            else {
+                isTruncated |= (digit != 0);
+            }
+        }
+    }
+    if(offset < text.count && (data[offset] == 'e' || data[offset] == 'E')) {
+        isInteger = 0;
+        offset += 1;
+        b32 isExponentNegative = (data[offset] == '-');
+        offset += (data[offset] == '-' || data[offset] == '+');
+        s64 explicitExponent = 0;
+        for(; offset < text.count && isNumeric((char)data[offset]); ++offset) {
+            // anything this big is already an overflow or an underflow
+            if(explicitExponent < 100000) {
+                explicitExponent = 10*explicitExponent + (data[offset] - '0');
+            }
+        }
+        exponent += isExponentNegative ? -explicitExponent : explicitExponent;
+    }
+
+    if(isInteger && exponent == 0 && mantissa <= INT64_MAX) {
+        value.isInteger = 1;
+        value.integer = isNegative ? -(s64)mantissa : (s64)mantissa;
+        return value;
+    }
+    if(!isTruncated && mantissa <= (1ull << 53) &&
+            exponent >= -22 && exponent <= 22) {
+        f64 real = (f64)mantissa;
+        real = (exponent < 0) ? real / exactPowersOfTen[-exponent] :
+            real * exactPowersOfTen[exponent];
+        value.real = isNegative ? -real : real;
+        return value;
+    }
+    Buffer cString = pushBuffer(arena, text);
+    u8 *terminator = pushArray(arena, 1, u8);
+    check(cString.data && terminator);
+    *terminator = 0;
+    value.real = strtod((char const*)cString.data, 0);
+    popFromMemoryArena(arena, cString.count + 1);
+    return value;
+}
+
 static Token
 parseNextToken(Cursor *cur) {
     Token tk = {0};
-    skipSpaces(cur);
+    if(cur->nextStructural >= cur->structuralCount) {
+        cur->offset = cur->buf.count;
+        tk.type = TK_END;
+        return tk;
+    }
+    cur->offset = cur->structurals[cur->nextStructural++];
     if(isCursorEnd(cur)) {
         tk.type = TK_END;
         return tk;
@@ -295,8 +708,7 @@ parseNextToken(Cursor *cur) {
         case '8':
         case '9':
         {
-            tk.type = TK_NUMBER;
-            parseNumber(cur);
+            tk.type = parseNumber(cur);
             break;
         }
     }
@@ -318,52 +730,139 @@ takeOffQuotes(Buffer buf) {
     return buf;
 }
 
-static json_Element parseList(
-        MemoryArena *arena, Cursor *cur, json_ElementType listType);
+static u16
+hashLabel(Buffer label)
+{
+    // FNV-1a folded into 16 bits
+    u32 hash = 2166136261u;
+    for(u64 i = 0; i < label.count; ++i) {
+        hash ^= label.data[i];
+        hash *= 16777619u;
+    }
+    return (u16)((hash >> 16) ^ hash);
+}
 
-static json_Element
-parseElementValue(MemoryArena *arena, Cursor *cur, Token elementValueTk)
+json_Key
+json_makeKey(Buffer label)
+{
+    json_Key key = {.label = label, .hash = hashLabel(label)};
+    return key;
+}
+
+static u64
+getTapeEntrySpan(json_TapeEntry const *entry)
+{
+    b32 isList = (entry->type == json_ARRAY || entry->type == json_OBJECT);
+    return isList ? entry->span : (entry->type == json_NUMBER) ? 2 : 1;
+}
+
+static json_TapeEntry const*
+getFirstListItemEntry(json_TapeEntry const *list)
+{
+    return list + ((list->type == json_OBJECT) ? 2 : 1);
+}
+
+static b32
+isLabelEntryEqual(json_TapeEntry const *labelEntry, json_Key key)
+{
+    Buffer label = {.data = labelEntry->data, .count = labelEntry->count};
+    return labelEntry->hash == key.hash && areEqual(label, key.label);
+}
+
+// Must be called once the whole object is in the tape. The table is an open
+// addressing one, holding the offsets of the label entries from the object
+// entry.
+static void
+buildObjectIndex(MemoryArena *arena, json_TapeEntry *object)
+{
+    json_TapeEntry *index = object + 1;
+    *index = (json_TapeEntry){.type = json_OBJECT_INDEX};
+    if(object->count < JSON_OBJECT_INDEX_MIN_COUNT) {
+        return;
+    }
+    u32 slotCount = 1;
+    while(slotCount < 2*object->count) {
+        slotCount *= 2;
+    }
+    // arenas start page aligned, but strings may have left the top unaligned
+    pushArray(arena, (sizeof(u32) - arena->count%sizeof(u32))%sizeof(u32), u8);
+    u32 *slots = pushArray(arena, slotCount, u32);
+    check(slots);
+    memset(slots, 0, slotCount*sizeof(u32));
+    u32 mask = slotCount - 1;
+    json_TapeEntry const *end = object + object->span;
+    for(json_TapeEntry const *label = getFirstListItemEntry(object);
+            label < end;
+            label += 1 + getTapeEntrySpan(label + 1)) {
+        u32 i = label->hash & mask;
+        while(slots[i]) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = (u32)(label - object);
+    }
+    index->data = (u8*)slots;
+    index->count = slotCount;
+}
+
+static json_TapeEntry*
+pushTapeEntry(Cursor *cur, json_ElementType type)
+{
+    static json_TapeEntry overflowEntry;
+    if(cur->tapeCount >= cur->tapeMaxCount) {
+        // can't happen, the tape is sized from the structural index
+        check(0 && "tape is full");
+        parsingError(cur, "tape is full");
+        return &overflowEntry;
+    }
+    json_TapeEntry *entry = &cur->tape[cur->tapeCount++];
+    *entry = (json_TapeEntry){.type = (u8)type};
+    return entry;
+}
+
+static void
+setTapeEntryText(MemoryArena *arena, Cursor const *cur,
+        json_TapeEntry *entry, Buffer text)
+{
+    Buffer content = cur->inPlace ? text : pushBuffer(arena, text);
+    entry->data = content.data;
+    entry->count = (u32)content.count;
+    if(entry->type == json_LABEL) {
+        entry->hash = hashLabel(content);
+    }
+}
+
+static void
+parseScalarValue(MemoryArena *arena, Cursor *cur, Token elementValueTk)
 {
-    json_Element element = {0};
     switch(elementValueTk.type) {
         case TK_NUMBER:
         {
-            element.type = json_NUMBER;
-            Buffer copy = pushBuffer(arena, elementValueTk.content);
-            element.value = copy;
+            json_TapeEntry *entry = pushTapeEntry(cur, json_NUMBER);
+            setTapeEntryText(arena, cur, entry, elementValueTk.content);
+            json_TapeEntry *value = pushTapeEntry(cur, json_NUMBER_VALUE);
+            *value = parseNumberValue(arena, elementValueTk.content);
             break;
         }
         case TK_STRING:
         {
-            element.type = json_STRING;
-            Buffer copy =
-                pushBuffer(arena, takeOffQuotes(elementValueTk.content));
-            element.value = copy;
+            json_TapeEntry *entry = pushTapeEntry(cur, json_STRING);
+            setTapeEntryText(arena, cur, entry,
+                    takeOffQuotes(elementValueTk.content));
             break;
         }
         case TK_FALSE:
         {
-            element.type = json_FALSE;
+            pushTapeEntry(cur, json_FALSE);
             break;
         }
         case TK_TRUE:
         {
-            element.type = json_TRUE;
+            pushTapeEntry(cur, json_TRUE);
             break;
         }
         case TK_NULL:
         {
-            element.type = json_NULL;
-            break;
-        }
-        case TK_OPEN_BRACE:
-        {
-            element = parseList(arena, cur, json_OBJECT);
-            break;
-        }
-        case TK_OPEN_BRACKET:
-        {
-            element = parseList(arena, cur, json_ARRAY);
+            pushTapeEntry(cur, json_NULL);
             break;
         }
         default:
@@ -372,226 +871,1492 @@ parseElementValue(MemoryArena *arena, Cursor *cur, Token elementValueTk)
             break;
         }
     }
-    return element;
 }
 
-static json_Element
-parseList(MemoryArena *arena, Cursor *cur, json_ElementType listType)
+// Reads the label and the colon of an object member, returns the token that
+// starts its value
+static Token
+parseMemberLabel(MemoryArena *arena, Cursor *cur, Token labelTk)
 {
-    check(listType == json_ARRAY || listType == json_OBJECT);
-
-    json_Element listElement = {0};
-    listElement.type = listType;
-
-    TokenType closingTkType =
-        (listType == json_OBJECT) ? TK_CLOSE_BRACE : TK_CLOSE_BRACKET;
-
-    Token tk = parseNextToken(cur);
-    if(tk.type == closingTkType) {
-        return listElement;
+    Token colonTk = parseNextToken(cur);
+    if(labelTk.type != TK_STRING) {
+        parsingError(cur, "expected string as label");
+    }
+    else if(colonTk.type != TK_COLON) {
+        parsingError(cur, "expected colon after label");
     }
+    else {
+        json_TapeEntry *labelEntry = pushTapeEntry(cur, json_LABEL);
+        setTapeEntryText(arena, cur, labelEntry, takeOffQuotes(labelTk.content));
+    }
+    return parseNextToken(cur);
+}
 
-    Token separatorTk = {0};
-    json_Element *lastSubElement = 0;
-    while(!isCursorEnd(cur)) {
-        Buffer label = {0};
-        if(listType == json_OBJECT) {
-            Token labelTk = tk;
-            Token colonTk = parseNextToken(cur);
-            if(labelTk.type != TK_STRING) {
-                parsingError(cur, "expected string as label");
+// Parses the list that starts with tk. The lists that are still open are kept
+// in an explicit stack instead of the call stack, so a document nested deeper
+// than JSON_MAX_DEPTH is a parsing error rather than a stack overflow.
+static void
+parseDocument(MemoryArena *arena, Cursor *cur, Token tk)
+{
+    // tape offsets of the open lists, the tape never moves while parsing
+    u64 openLists[JSON_MAX_DEPTH];
+    u64 depth = 0;
+    while(!cur->errorOccurred) {
+        // tk starts a value here
+        if(tk.type == TK_OPEN_BRACE || tk.type == TK_OPEN_BRACKET) {
+            if(depth >= JSON_MAX_DEPTH) {
+                parsingError(cur, "lists are nested too deeply");
+                return;
             }
-            else if(colonTk.type != TK_COLON) {
-                parsingError(cur, "expected colon after label");
+            json_ElementType listType =
+                (tk.type == TK_OPEN_BRACE) ? json_OBJECT : json_ARRAY;
+            TokenType closingTkType =
+                (tk.type == TK_OPEN_BRACE) ? TK_CLOSE_BRACE : TK_CLOSE_BRACKET;
+            openLists[depth++] = cur->tapeCount;
+            pushTapeEntry(cur, listType);
+            if(listType == json_OBJECT) {
+                pushTapeEntry(cur, json_OBJECT_INDEX);
             }
-            label = takeOffQuotes(labelTk.content);
-
             tk = parseNextToken(cur);
-        }
-        Token elementValueTk = tk;
-        json_Element *subElement = pushStruct(arena, json_Element);
-        check(subElement);
-        *subElement = parseElementValue(arena, cur, elementValueTk);
-        subElement->label = pushBuffer(arena, label);
-        if(lastSubElement) {
-            lastSubElement->nextSibling = subElement;
+            if(tk.type != closingTkType) {
+                if(listType == json_OBJECT) {
+                    tk = parseMemberLabel(arena, cur, tk);
+                }
+                continue;
+            }
+            // empty lists are closed right away
+            json_TapeEntry *list = &cur->tape[openLists[--depth]];
+            list->span = cur->tapeCount - openLists[depth];
         }
         else {
-            listElement.firstSubElement = subElement;
+            parseScalarValue(arena, cur, tk);
+        }
+
+        // a value was just finished, close every list that ends after it
+        while(depth && !cur->errorOccurred) {
+            json_TapeEntry *list = &cur->tape[openLists[depth - 1]];
+            TokenType closingTkType = (list->type == json_OBJECT) ?
+                TK_CLOSE_BRACE : TK_CLOSE_BRACKET;
+            list->count += 1;
+            Token separatorTk = parseNextToken(cur);
+            if(separatorTk.type == TK_COMMA) {
+                tk = parseNextToken(cur);
+                if(list->type == json_OBJECT) {
+                    tk = parseMemberLabel(arena, cur, tk);
+                }
+                break;
+            }
+            else if(separatorTk.type == closingTkType) {
+                depth -= 1;
+                list->span = cur->tapeCount - openLists[depth];
+                if(list->type == json_OBJECT) {
+                    buildObjectIndex(arena, list);
+                }
+            }
+            else if(separatorTk.type == TK_END) {
+                parsingError(cur, "list was not closed");
+            }
+            else {
+                parsingError(cur, "expected a comma");
+            }
         }
-        lastSubElement = subElement;
-        separatorTk = parseNextToken(cur);
-        if(separatorTk.type != TK_COMMA && separatorTk.type != closingTkType) {
-            parsingError(cur, "expected a comma");
+        if(!depth) {
+            return;
         }
-        if(separatorTk.type == closingTkType) {
-            break;
+    }
+}
+
+static json_Element
+makeElement(json_TapeEntry const *entry, json_TapeEntry const *listEnd)
+{
+    json_Element element = {0};
+    if(entry < listEnd && entry->type == json_LABEL) {
+        element.label = (Buffer){.data = entry->data, .count = entry->count};
+        entry += 1;
+    }
+    if(entry < listEnd) {
+        element.type = (json_ElementType)entry->type;
+        element.entry = entry;
+        element.listEnd = listEnd;
+        if(element.type == json_STRING || element.type == json_NUMBER) {
+            element.value =
+                (Buffer){.data = entry->data, .count = entry->count};
         }
-        tk = parseNextToken(cur);
     }
-    if(separatorTk.type != closingTkType) {
-        parsingError(cur, "list was not closed");
+    return element;
+}
+
+static json_Element
+makeRootElement(json_TapeEntry const *tape, u64 tapeCount)
+{
+    json_Element root = {0};
+    if(tapeCount) {
+        root = makeElement(tape, tape + getTapeEntrySpan(tape));
     }
-    return listElement;
+    return root;
 }
 
-json_Element*
-json_parseJson(MemoryArena *arena, Buffer jsonString) {
+static json_Element
+parseJson(MemoryArena *arena, Buffer jsonString, b32 inPlace) {
     Cursor cur = {0};
     cur.buf = jsonString;
+    cur.inPlace = inPlace;
+    json_StructuralIndex index = buildStructuralIndex(arena, jsonString);
+    cur.structurals = index.offsets;
+    cur.structuralCount = index.count;
+    // every token takes at most one entry, except for objects and numbers
+    // which take two. Closing braces and the separators before numbers take
+    // none, so this is still enough.
+    cur.tapeMaxCount = index.count + 1;
+    // the structural offsets are u32s, there may be an odd number of them
+    u64 tapeAlignment = _Alignof(json_TapeEntry);
+    pushArray(arena, (tapeAlignment - arena->count%tapeAlignment)%tapeAlignment,
+            u8);
+    cur.tape = pushArray(arena, cur.tapeMaxCount, json_TapeEntry);
+    check(cur.tape);
+    check((uintptr_t)cur.tape % tapeAlignment == 0);
     Token tk = parseNextToken(&cur);
     if(tk.type != TK_OPEN_BRACE && tk.type != TK_OPEN_BRACKET)
     {
         parsingError(&cur, "expected opening list");
-        return 0;
+        return (json_Element){0};
+    }
+    parseDocument(arena, &cur, tk);
+    if(cur.errorOccurred) {
+        return (json_Element){0};
     }
-    json_Element *head = pushStruct(arena, json_Element);
-    check(head);
-    *head = parseElementValue(arena, &cur, tk);
-    return head;
+    return makeRootElement(cur.tape, cur.tapeCount);
 }
 
-static f64
-takePower(f64 base, s64 exponent)
-{
-    if(base == 0) {
-        return 0;
-    }
+// On failure the returned element has json_INVALID_ELEMENT type
+json_Element
+json_parseJson(MemoryArena *arena, Buffer jsonString) {
+    return parseJson(arena, jsonString, 0);
+}
 
-    s64 exponentSign = (exponent < 0) ? -1 : 1;
-    if(exponent < 0) {
-        exponent = -exponent;
-    }
-    f64 a = 1;
-    // the product a*(base^exponent) is invariant on the loop
-    while(exponent > 0) {
-        if(exponent % 2 == 0) {
-            base = base * base;
-            exponent = exponent / 2;
-        }
-        else {
-            a = (exponentSign == 1) ? a * base : a / base;
-            exponent -= 1;
+// Same as json_parseJson, but the values and labels of the tree point
+// straight into jsonString, so it must outlive the tree. Values that are kept
+// for longer must be copied by the caller.
+json_Element
+json_parseJsonInPlace(MemoryArena *arena, Buffer jsonString) {
+    return parseJson(arena, jsonString, 1);
+}
+
+// Projections
+//
+// A projection is the set of paths of a document the caller cares about,
+// e.g. "items[].track.name" or "total". Everything that is not on one of those
+// paths is skipped by the streaming parser, which only matches brackets and
+// quotes to find where skipped values end and doesn't allocate anything for
+// them. The value at the end of a path is kept whole, with all its contents.
+//
+// A path can also have a callback, which the streaming parser calls with every
+// object or array found at that path as soon as it's complete. The value is
+// dropped from the tape after the call, so e.g. a long array can be consumed
+// one item at a time without ever being in memory whole.
+
+typedef void json_StreamValueFunction(json_Element value, void *userData);
+
+typedef struct json_ProjectionNode {
+    Buffer label;
+    u16 labelHash;
+    b32 isArrayItem;
+    b32 isWhole;
+    json_StreamValueFunction *streamValue;
+    struct json_ProjectionNode *firstChild;
+    struct json_ProjectionNode *nextSibling;
+} json_ProjectionNode;
+
+typedef struct json_Projection {
+    json_ProjectionNode root;
+} json_Projection;
+
+static json_ProjectionNode*
+getProjectionChild(MemoryArena *arena, json_ProjectionNode *node,
+        Buffer label, b32 isArrayItem)
+{
+    json_ProjectionNode *child = node->firstChild;
+    while(child) {
+        if(child->isArrayItem == isArrayItem && areEqual(child->label, label)) {
+            return child;
         }
+        child = child->nextSibling;
     }
-    return a;
+    child = pushStruct(arena, json_ProjectionNode);
+    check(child);
+    *child = (json_ProjectionNode){
+        .label = pushBuffer(arena, label),
+        .labelHash = hashLabel(label),
+        .isArrayItem = isArrayItem,
+        .nextSibling = node->firstChild,
+    };
+    node->firstChild = child;
+    return child;
 }
 
-f64
-json_getNumber(json_Element element)
+// Labels in the path are separated by '.', and "[]" after a label means
+// every item of that array, as in "items[].track.artists[].name".
+static json_ProjectionNode*
+getProjectionNode(MemoryArena *arena, json_Projection *projection,
+        Buffer path)
 {
-    if(element.type != json_NUMBER) {
-        return 0;
-    }
-    Buffer buf = element.value;
+    json_ProjectionNode *node = &projection->root;
     u64 offset = 0;
-    char *data = (char*)buf.data;
-    char lastRead = data[offset];
-    s64 resultSign = 1;
-    if(lastRead == '-') {
-        resultSign = -1;
-        offset += 1;
-    }
-    f64 integerPart = 0;
-    while(isInBounds(buf, offset)) {
-        lastRead = data[offset++];
-        if(!isNumeric(lastRead)) {
-            break;
+    while(offset < path.count) {
+        Buffer label = {.data = path.data + offset};
+        while(offset < path.count &&
+                path.data[offset] != '.' && path.data[offset] != '[') {
+            label.count += 1;
+            offset += 1;
         }
-        integerPart = (lastRead - '0') + 10*integerPart;
-    }
-    f64 decimalPart = 0;
-    if(lastRead == '.') {
-        f64 c = 1;
-        while(isInBounds(buf, offset)) {
-            lastRead = data[offset++];
-            if(!isNumeric(lastRead)) {
-                break;
-            }
-            c *= 0.1;
-            decimalPart += c*(lastRead - '0');
+        if(label.count) {
+            node = getProjectionChild(arena, node, label, 0);
         }
-    }
-
-    s64 exponent = 0;
-    s64 exponentSign = 1; 
-    if(lastRead == 'e' || lastRead == 'E') {
-        lastRead = data[offset];
-        if(lastRead == '+' || lastRead == '-') {
-            offset += 1;
-            if(lastRead == '-') {
-                exponentSign = -1;
-            }
+        while(offset + 1 < path.count &&
+                path.data[offset] == '[' && path.data[offset + 1] == ']') {
+            node = getProjectionChild(arena, node, (Buffer){0}, 1);
+            offset += 2;
         }
-        while(isInBounds(buf, offset)) {
-            lastRead = data[offset++];
-            if(!isNumeric(lastRead)) {
-                break;
-            }
-            exponent = (lastRead - '0') + 10*exponent;
+        if(offset < path.count && path.data[offset] == '.') {
+            offset += 1;
         }
     }
-    f64 result = integerPart + decimalPart;
-    result *= takePower(10,exponent*exponentSign);
-    result *= resultSign;
-    return result;
+    return node;
 }
 
-u64
-json_getArrayCount(json_Element array)
+void
+json_addProjectionPath(MemoryArena *arena, json_Projection *projection,
+        Buffer path)
 {
-    u64 count = 0;
-    if(array.type == json_ARRAY) {
-        for(json_Element *element = array.firstSubElement;
-                element;
-                element = element->nextSibling) {
-            count += 1;
-        }
+    getProjectionNode(arena, projection, path)->isWhole = 1;
+}
+
+// The callback gets the userData given to json_beginStream. Values at the
+// root of the document are never handed to callbacks.
+void
+json_setProjectionCallback(MemoryArena *arena, json_Projection *projection,
+        Buffer path, json_StreamValueFunction *function)
+{
+    getProjectionNode(arena, projection, path)->streamValue = function;
+}
+
+// Follows the items of arrays down to the node whose members are listed
+static json_ProjectionNode const*
+skipProjectionArrayItems(json_ProjectionNode const *node)
+{
+    while(!node->isWhole && node->firstChild &&
+            node->firstChild->isArrayItem) {
+        node = node->firstChild;
     }
-    return count;
+    return node;
 }
 
-json_Element
-json_getElement(json_Element element, Buffer label)
+// Paths are only a few labels long, so the recursion doesn't go deep
+static void
+pushProjectionFields(MemoryArena *arena, json_ProjectionNode const *node)
 {
-    if(element.type == json_OBJECT && label.data) {
-        json_Element *newElement = element.firstSubElement;
-        while(newElement) {
-            if(areEqual(label, newElement->label)) {
-                return *newElement;
-            }
-            newElement = newElement->nextSibling;
+    b32 isFirst = 1;
+    for(json_ProjectionNode const *child = node->firstChild;
+            child;
+            child = child->nextSibling) {
+        if(child->isArrayItem) {
+            continue;
+        }
+        if(!isFirst) {
+            pushBuffer(arena, CONSTANT_STRING(","));
+        }
+        isFirst = 0;
+        pushBuffer(arena, child->label);
+        json_ProjectionNode const *members = skipProjectionArrayItems(child);
+        if(!members->isWhole && members->firstChild) {
+            pushBuffer(arena, CONSTANT_STRING("("));
+            pushProjectionFields(arena, members);
+            pushBuffer(arena, CONSTANT_STRING(")"));
         }
     }
-    return (json_Element){0};
 }
 
-void
-json_printElement(json_Element *element)
+// Writes the projection the way web APIs like spotify's take it in their
+// "fields" parameter, so the server only sends what the parser would keep.
+// Members are separated by commas and those of an object or of the items of
+// an array go in parentheses after its label, e.g. "items[].track.name" and
+// "total" become "total,items(track(name))".
+Buffer
+json_writeProjectionFields(MemoryArena *arena,
+        json_Projection const *projection)
 {
-    // NOTE: exchanging this loop by a recursion may result in stack overflow
-    while(element) {
-        printBuffer(element->label);
-        printf(":");
-        switch(element->type) {
-            case json_INVALID_ELEMENT: break;
-            case json_TRUE: printf("true"); break;
-            case json_FALSE: printf("false");break;
-            case json_NULL: printf("null"); break;
-            case json_NUMBER: printf("%f", json_getNumber(*element)); break;
-            case json_STRING: printBuffer(element->value); break;
-            case json_ARRAY: printf("["); break;
-            case json_OBJECT: printf("{"); break;
-        }
+    Buffer fields = {.data = arena->data + arena->count};
+    pushProjectionFields(arena, skipProjectionArrayItems(&projection->root));
+    fields.count = arena->data + arena->count - fields.data;
+    return fields;
+}
+
+// Streaming parser
+//
+// json_feedStream can be called with consecutive pieces of a JSON text, as
+// they arrive from the network, and builds the same tape as json_parseJson.
+// All of its progress is kept inside json_StreamParser, so a token can be
+// split between two pieces. Strings and numbers are copied into the string
+// arena as they are read, so the pieces themselves can be thrown away right
+// after each call.
+//
+// Since the tape and the strings grow in place at the top of their arenas,
+// nothing else can push to those arenas while a stream is being parsed.
+
+typedef enum json_StreamState {
+    json_STREAM_BEGIN,
+    json_STREAM_VALUE,
+    json_STREAM_FIRST_VALUE,
+    json_STREAM_KEY,
+    json_STREAM_FIRST_KEY,
+    json_STREAM_COLON,
+    json_STREAM_AFTER_VALUE,
+    json_STREAM_STRING,
+    json_STREAM_STRING_ESCAPE,
+    json_STREAM_NUMBER,
+    json_STREAM_KEYWORD,
+    json_STREAM_SKIP_SCALAR,
+    json_STREAM_SKIP_STRING,
+    json_STREAM_SKIP_ESCAPE,
+    json_STREAM_SKIP_LIST,
+    json_STREAM_DONE,
+    json_STREAM_ERROR,
+} json_StreamState;
+
+typedef struct json_StreamFrame {
+    json_TapeEntry *list;
+    // zero when everything inside the list is kept
+    json_ProjectionNode const *projection;
+    json_StreamValueFunction *streamValue;
+    // size of the string arena when the list was opened
+    u64 stringCount;
+} json_StreamFrame;
 
-        printf("\n");
-        json_printElement(element->firstSubElement);
+typedef struct json_StreamParser {
+    MemoryArena *tapeArena;
+    MemoryArena *stringArena;
+    json_StreamState state;
+    json_TapeEntry *tape;
+    json_StreamFrame stack[JSON_MAX_DEPTH];
+    u64 depth;
+    // entry whose string or number is being read
+    json_TapeEntry *current;
+    // label of the next element, it's being read when readingKey is set
+    Buffer label;
+    u16 labelHash;
+    b32 readingKey;
+    Buffer keyword;
+    u64 keywordMatchCount;
+    json_Projection const *projection;
+    u64 skipDepth;
+    void *userData;
+} json_StreamParser;
 
-        switch(element->type) {
-            case json_ARRAY: printf("]\n"); break;
-            case json_OBJECT: printf("}\n"); break;
-            default: break;
+static void
+streamError(json_StreamParser *parser, char const *message)
+{
+    if(parser->state != json_STREAM_ERROR) {
+        fprintf(stderr, "JSON ERROR: %s\n", message);
+    }
+    parser->state = json_STREAM_ERROR;
+}
+
+static void
+appendToStreamString(json_StreamParser *parser, u8 const *data, u64 count)
+{
+    u8 *dest = pushToMemoryArena(parser->stringArena, count);
+    check(dest);
+    memcpy(dest, data, count);
+    if(parser->readingKey) {
+        check(dest == parser->label.data + parser->label.count &&
+                "string must grow contiguously");
+        parser->label.count += count;
+    }
+    else {
+        check(dest == parser->current->data + parser->current->count &&
+                "string must grow contiguously");
+        parser->current->count += (u32)count;
+    }
+}
+
+static json_TapeEntry*
+pushStreamEntry(json_StreamParser *parser, json_ElementType type)
+{
+    if(parser->depth > 0) {
+        json_StreamFrame *frame = &parser->stack[parser->depth - 1];
+        frame->list->count += 1;
+        if(frame->list->type == json_OBJECT) {
+            json_TapeEntry *labelEntry =
+                pushStruct(parser->tapeArena, json_TapeEntry);
+            check(labelEntry);
+            *labelEntry = (json_TapeEntry){
+                .type = json_LABEL,
+                .hash = parser->labelHash,
+                .count = (u32)parser->label.count,
+                .data = parser->label.data,
+            };
+        }
+    }
+    parser->label = (Buffer){0};
+    parser->labelHash = 0;
+    json_TapeEntry *entry = pushStruct(parser->tapeArena, json_TapeEntry);
+    check(entry);
+    *entry = (json_TapeEntry){.type = (u8)type};
+    if(!parser->tape) {
+        parser->tape = entry;
+    }
+    return entry;
+}
+
+static void
+openStreamList(json_StreamParser *parser, json_ElementType listType,
+        json_ProjectionNode const *projection)
+{
+    if(parser->depth >= JSON_MAX_DEPTH) {
+        streamError(parser, "lists nested too deeply");
+        return;
+    }
+    json_TapeEntry *list = pushStreamEntry(parser, listType);
+    if(listType == json_OBJECT) {
+        json_TapeEntry *index = pushStruct(parser->tapeArena, json_TapeEntry);
+        check(index);
+        *index = (json_TapeEntry){.type = json_OBJECT_INDEX};
+    }
+    parser->stack[parser->depth++] = (json_StreamFrame){
+        .list = list,
+        .projection = (projection && !projection->isWhole) ? projection : 0,
+        .streamValue = projection ? projection->streamValue : 0,
+        .stringCount = parser->stringArena->count,
+    };
+    parser->state = (listType == json_OBJECT) ?
+        json_STREAM_FIRST_KEY : json_STREAM_FIRST_VALUE;
+}
+
+static void
+closeStreamList(json_StreamParser *parser, char ch)
+{
+    json_TapeEntry *list = parser->stack[parser->depth - 1].list;
+    char closingCh = (list->type == json_OBJECT) ? '}' : ']';
+    if(ch != closingCh) {
+        streamError(parser, "list was not closed");
+        return;
+    }
+    json_TapeEntry *top = pushArray(parser->tapeArena, 0, json_TapeEntry);
+    list->span = (u64)(top - list);
+    if(list->type == json_OBJECT) {
+        // no string is being read, so the string arena is free to use
+        buildObjectIndex(parser->stringArena, list);
+    }
+    json_StreamFrame frame = parser->stack[--parser->depth];
+    parser->state =
+        (parser->depth == 0) ? json_STREAM_DONE : json_STREAM_AFTER_VALUE;
+
+    if(frame.streamValue && parser->depth > 0) {
+        frame.streamValue(makeElement(list, top), parser->userData);
+        // drop the value, along with its label
+        json_TapeEntry *parent = parser->stack[parser->depth - 1].list;
+        json_TapeEntry *start = (parent->type == json_OBJECT) ? list - 1 : list;
+        parent->count -= 1;
+        popFromMemoryArena(parser->tapeArena,
+                (u64)(top - start)*sizeof(json_TapeEntry));
+        popFromMemoryArena(parser->stringArena,
+                parser->stringArena->count - frame.stringCount);
+    }
+}
+
+// Returns whether the value about to be read is on one of the projected
+// paths, and the projection node that applies to it.
+static b32
+findStreamProjection(json_StreamParser const *parser,
+        json_ProjectionNode const **projection)
+{
+    *projection = 0;
+    if(parser->depth == 0) {
+        *projection = parser->projection ? &parser->projection->root : 0;
+        return 1;
+    }
+    json_StreamFrame const *frame = &parser->stack[parser->depth - 1];
+    if(!frame->projection) {
+        return 1;
+    }
+    b32 isArrayItem = (frame->list->type == json_ARRAY);
+    json_ProjectionNode const *child = frame->projection->firstChild;
+    while(child) {
+        b32 matches = isArrayItem ? child->isArrayItem :
+            (!child->isArrayItem && child->labelHash == parser->labelHash &&
+             areEqual(child->label, parser->label));
+        if(matches) {
+            *projection = child;
+            return 1;
+        }
+        child = child->nextSibling;
+    }
+    return 0;
+}
+
+static void
+beginStreamSkip(json_StreamParser *parser, char ch)
+{
+    // the label was the last thing pushed, it isn't needed anymore
+    popFromMemoryArena(parser->stringArena, parser->label.count);
+    parser->label = (Buffer){0};
+    parser->skipDepth = 0;
+    if(ch == '{' || ch == '[') {
+        parser->skipDepth = 1;
+        parser->state = json_STREAM_SKIP_LIST;
+    }
+    else if(ch == '"') {
+        parser->state = json_STREAM_SKIP_STRING;
+    }
+    else {
+        parser->state = json_STREAM_SKIP_SCALAR;
+    }
+}
+
+static void
+beginStreamValue(json_StreamParser *parser, char ch)
+{
+    json_ProjectionNode const *projection = 0;
+    if(!findStreamProjection(parser, &projection)) {
+        beginStreamSkip(parser, ch);
+        return;
+    }
+    switch(ch) {
+        case '{':
+        {
+            openStreamList(parser, json_OBJECT, projection);
+            break;
+        }
+        case '[':
+        {
+            openStreamList(parser, json_ARRAY, projection);
+            break;
+        }
+        case '"':
+        {
+            parser->current = pushStreamEntry(parser, json_STRING);
+            parser->current->data = pushArray(parser->stringArena, 0, u8);
+            parser->readingKey = 0;
+            parser->state = json_STREAM_STRING;
+            break;
+        }
+        case 't':
+        case 'f':
+        case 'n':
+        {
+            pushStreamEntry(parser,
+                (ch == 't') ? json_TRUE : (ch == 'f') ? json_FALSE : json_NULL);
+            parser->keyword =
+                (ch == 't') ? CONSTANT_STRING("true") :
+                (ch == 'f') ? CONSTANT_STRING("false") : CONSTANT_STRING("null");
+            parser->keywordMatchCount = 1;
+            parser->state = json_STREAM_KEYWORD;
+            break;
+        }
+        case '-':
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9':
+        {
+            parser->current = pushStreamEntry(parser, json_NUMBER);
+            parser->current->data = pushArray(parser->stringArena, 0, u8);
+            parser->readingKey = 0;
+            appendToStreamString(parser, (u8 const*)&ch, 1);
+            parser->state = json_STREAM_NUMBER;
+            break;
+        }
+        default:
+        {
+            streamError(parser, "invalid element value");
+            break;
+        }
+    }
+}
+
+static void
+finishStreamNumber(json_StreamParser *parser)
+{
+    Cursor numberCursor = {
+        .buf = {.data = parser->current->data, .count = parser->current->count},
+    };
+    TokenType numberTkType = parseNumber(&numberCursor);
+    if(numberTkType == TK_INVALID ||
+            numberCursor.offset != numberCursor.buf.count) {
+        streamError(parser, "invalid number");
+        return;
+    }
+    // the number entry is still the top of the tape
+    json_TapeEntry *value = pushStruct(parser->tapeArena, json_TapeEntry);
+    check(value);
+    *value = parseNumberValue(parser->stringArena, numberCursor.buf);
+    parser->state = json_STREAM_AFTER_VALUE;
+}
+
+static void
+readStreamStructuralCharacter(json_StreamParser *parser, char ch)
+{
+    switch(parser->state) {
+        case json_STREAM_BEGIN:
+        {
+            if(ch == '{' || ch == '[') {
+                beginStreamValue(parser, ch);
+            }
+            else {
+                streamError(parser, "expected opening list");
+            }
+            break;
+        }
+        case json_STREAM_FIRST_VALUE:
+        case json_STREAM_VALUE:
+        {
+            if(ch == ']' && parser->state == json_STREAM_FIRST_VALUE) {
+                closeStreamList(parser, ch);
+            }
+            else {
+                beginStreamValue(parser, ch);
+            }
+            break;
+        }
+        case json_STREAM_FIRST_KEY:
+        case json_STREAM_KEY:
+        {
+            if(ch == '}' && parser->state == json_STREAM_FIRST_KEY) {
+                closeStreamList(parser, ch);
+            }
+            else if(ch == '"') {
+                parser->label.data = pushArray(parser->stringArena, 0, u8);
+                parser->label.count = 0;
+                parser->readingKey = 1;
+                parser->state = json_STREAM_STRING;
+            }
+            else {
+                streamError(parser, "expected string as label");
+            }
+            break;
+        }
+        case json_STREAM_COLON:
+        {
+            if(ch == ':') {
+                parser->state = json_STREAM_VALUE;
+            }
+            else {
+                streamError(parser, "expected colon after label");
+            }
+            break;
+        }
+        case json_STREAM_AFTER_VALUE:
+        {
+            json_ElementType listType =
+                parser->stack[parser->depth - 1].list->type;
+            if(ch == ',') {
+                parser->state = (listType == json_OBJECT) ?
+                    json_STREAM_KEY : json_STREAM_VALUE;
+            }
+            else if(ch == '}' || ch == ']') {
+                closeStreamList(parser, ch);
+            }
+            else {
+                streamError(parser, "expected a comma");
+            }
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+}
+
+// projection can be zero, in which case the whole document is kept.
+// userData is passed to the projection's callbacks.
+void
+json_beginStream(json_StreamParser *parser,
+        MemoryArena *tapeArena, MemoryArena *stringArena,
+        json_Projection const *projection, void *userData)
+{
+    *parser = (json_StreamParser){
+        .tapeArena = tapeArena,
+        .stringArena = stringArena,
+        .projection = projection,
+        .userData = userData,
+    };
+}
+
+b32
+json_feedStream(json_StreamParser *parser, Buffer chunk)
+{
+    u64 offset = 0;
+    while(offset < chunk.count) {
+        char ch = (char)chunk.data[offset];
+        switch(parser->state) {
+            case json_STREAM_STRING:
+            {
+                u8 const *run = chunk.data + offset;
+                u64 runCount = findQuoteOrBackslash(run, chunk.count - offset);
+                appendToStreamString(parser, run, runCount);
+                offset += runCount;
+                if(offset < chunk.count) {
+                    ch = (char)chunk.data[offset];
+                    offset += 1;
+                    if(ch == '"' && parser->readingKey) {
+                        parser->labelHash = hashLabel(parser->label);
+                        parser->state = json_STREAM_COLON;
+                    }
+                    else if(ch == '"') {
+                        parser->state = json_STREAM_AFTER_VALUE;
+                    }
+                    else {
+                        // escapes are kept as they are, like in json_parseJson
+                        appendToStreamString(parser, (u8 const*)&ch, 1);
+                        parser->state = json_STREAM_STRING_ESCAPE;
+                    }
+                }
+                break;
+            }
+            case json_STREAM_STRING_ESCAPE:
+            {
+                appendToStreamString(parser, (u8 const*)&ch, 1);
+                offset += 1;
+                parser->state = json_STREAM_STRING;
+                break;
+            }
+            case json_STREAM_NUMBER:
+            {
+                if(isSeparator(ch) || !ch) {
+                    // the separator is read again in the next state
+                    finishStreamNumber(parser);
+                }
+                else {
+                    appendToStreamString(parser, (u8 const*)&ch, 1);
+                    offset += 1;
+                }
+                break;
+            }
+            case json_STREAM_KEYWORD:
+            {
+                u64 matchCount = parser->keywordMatchCount;
+                if(ch == (char)parser->keyword.data[matchCount]) {
+                    parser->keywordMatchCount += 1;
+                    offset += 1;
+                    if(parser->keywordMatchCount == parser->keyword.count) {
+                        parser->state = json_STREAM_AFTER_VALUE;
+                    }
+                }
+                else {
+                    streamError(parser, "invalid element value");
+                }
+                break;
+            }
+            case json_STREAM_SKIP_SCALAR:
+            {
+                if(isSeparator(ch) || !ch) {
+                    parser->state = json_STREAM_AFTER_VALUE;
+                }
+                else {
+                    offset += 1;
+                }
+                break;
+            }
+            case json_STREAM_SKIP_STRING:
+            {
+                offset += findQuoteOrBackslash(
+                        chunk.data + offset, chunk.count - offset);
+                if(offset < chunk.count) {
+                    ch = (char)chunk.data[offset];
+                    offset += 1;
+                    if(ch == '"') {
+                        parser->state = parser->skipDepth ?
+                            json_STREAM_SKIP_LIST : json_STREAM_AFTER_VALUE;
+                    }
+                    else {
+                        parser->state = json_STREAM_SKIP_ESCAPE;
+                    }
+                }
+                break;
+            }
+            case json_STREAM_SKIP_ESCAPE:
+            {
+                offset += 1;
+                parser->state = json_STREAM_SKIP_STRING;
+                break;
+            }
+            case json_STREAM_SKIP_LIST:
+            {
+                offset += findQuoteOrBracket(
+                        chunk.data + offset, chunk.count - offset);
+                if(offset < chunk.count) {
+                    ch = (char)chunk.data[offset];
+                    offset += 1;
+                    if(ch == '"') {
+                        parser->state = json_STREAM_SKIP_STRING;
+                    }
+                    else if(ch == '{' || ch == '[') {
+                        parser->skipDepth += 1;
+                    }
+                    else {
+                        parser->skipDepth -= 1;
+                        if(parser->skipDepth == 0) {
+                            parser->state = json_STREAM_AFTER_VALUE;
+                        }
+                    }
+                }
+                break;
+            }
+            case json_STREAM_DONE:
+            case json_STREAM_ERROR:
+            {
+                // whatever comes after the top list is ignored
+                offset = chunk.count;
+                break;
+            }
+            default:
+            {
+                offset += 1;
+                if(!isSpace(ch) && ch) {
+                    readStreamStructuralCharacter(parser, ch);
+                }
+                break;
+            }
+        }
+    }
+    return parser->state != json_STREAM_ERROR;
+}
+
+// On failure the returned element has json_INVALID_ELEMENT type
+json_Element
+json_endStream(json_StreamParser *parser)
+{
+    if(parser->state != json_STREAM_DONE) {
+        streamError(parser, "list was not closed");
+        return (json_Element){0};
+    }
+    return makeRootElement(parser->tape, 1);
+}
+
+// On-demand cursor
+//
+// For documents that are read once, a few fields at a time, a json_Cursor
+// reads straight from the text without building a tape or allocating
+// anything. A cursor points to one value and nothing in it is looked at until
+// one of the functions below is called on it. Members and items are read
+// going forward, and the values that are passed over are skipped by matching
+// quotes and brackets, like the streaming parser does with unprojected
+// values.
+//
+// Reading the fields of an object in the order they appear in the text is a
+// single pass over it. Any other order still works, but each lookup that goes
+// back wraps around to the beginning of the object.
+
+typedef struct json_Cursor {
+    Buffer text;
+    // start of the value
+    u64 offset;
+    // objects and arrays only, start of the next member or item, or of the
+    // last one returned when isNextPending is set
+    u64 next;
+    b32 isOpen;
+    b32 isNextPending;
+} json_Cursor;
+
+static u64
+skipRawSpaces(Buffer text, u64 offset)
+{
+    while(offset < text.count && isSpace((char)text.data[offset])) {
+        offset += 1;
+    }
+    return offset;
+}
+
+// Returns the offset right after the string whose opening quote is at offset,
+// or text.count if it isn't closed
+static u64
+skipRawString(Buffer text, u64 offset)
+{
+    offset += 1;
+    while(offset < text.count) {
+        offset += findQuoteOrBackslash(text.data + offset, text.count - offset);
+        if(offset >= text.count) {
+            break;
+        }
+        if(text.data[offset] == '"') {
+            return offset + 1;
+        }
+        offset += 2;
+    }
+    return text.count;
+}
+
+// Returns the offset right after the value that starts at offset
+static u64
+skipRawValue(Buffer text, u64 offset)
+{
+    if(offset >= text.count) {
+        return text.count;
+    }
+    char ch = (char)text.data[offset];
+    if(ch == '"') {
+        return skipRawString(text, offset);
+    }
+    if(ch == '{' || ch == '[') {
+        u64 depth = 0;
+        while(offset < text.count) {
+            offset += findQuoteOrBracket(text.data + offset, text.count - offset);
+            if(offset >= text.count) {
+                break;
+            }
+            ch = (char)text.data[offset];
+            if(ch == '"') {
+                offset = skipRawString(text, offset);
+                continue;
+            }
+            offset += 1;
+            depth += (ch == '{' || ch == '[') ? 1 : -1;
+            if(depth == 0) {
+                return offset;
+            }
+        }
+        return text.count;
+    }
+    while(offset < text.count && !isSeparator((char)text.data[offset])) {
+        offset += 1;
+    }
+    return offset;
+}
+
+// Moves list->next to the start of the next member or item, or to the closing
+// bracket. Returns 0 at the end of the list or on malformed text.
+static b32
+advanceCursorList(json_Cursor *list, char openChar, char closeChar)
+{
+    Buffer text = list->text;
+    if(!list->isOpen) {
+        if(list->offset >= text.count || text.data[list->offset] != openChar) {
+            return 0;
+        }
+        list->isOpen = 1;
+        list->next = skipRawSpaces(text, list->offset + 1);
+        return list->next < text.count && text.data[list->next] != closeChar;
+    }
+    if(list->isNextPending) {
+        list->isNextPending = 0;
+        if(openChar == '{') {
+            list->next = skipRawString(text, list->next);
+            list->next = skipRawSpaces(text, list->next);
+            list->next = skipRawSpaces(text, list->next + 1);
+        }
+        list->next = skipRawValue(text, list->next);
+        list->next = skipRawSpaces(text, list->next);
+        if(list->next < text.count && text.data[list->next] == ',') {
+            list->next = skipRawSpaces(text, list->next + 1);
+            return list->next < text.count;
+        }
+    }
+    return 0;
+}
+
+json_Cursor
+json_makeCursor(Buffer text)
+{
+    json_Cursor cursor = {.text = text, .offset = skipRawSpaces(text, 0)};
+    return cursor;
+}
+
+// Item is set to the next item of the array, returns 0 when there are no more
+b32
+json_iterateArray(json_Cursor *array, json_Cursor *item)
+{
+    if(!advanceCursorList(array, '[', ']')) {
+        return 0;
+    }
+    array->isNextPending = 1;
+    *item = (json_Cursor){.text = array->text, .offset = array->next};
+    return 1;
+}
+
+// Value is set to the value of the member with the given label, returns 0 if
+// there's no such member
+b32
+json_findField(json_Cursor *object, json_Key key, json_Cursor *value)
+{
+    Buffer text = object->text;
+    u64 firstVisited = 0;
+    b32 hasWrapped = 0;
+    for(;;) {
+        b32 hasMember = advanceCursorList(object, '{', '}');
+        if(!object->isOpen) {
+            return 0;
+        }
+        if(!hasMember) {
+            // go back to the first member, once
+            if(hasWrapped) {
+                return 0;
+            }
+            hasWrapped = 1;
+            object->isOpen = 0;
+            object->isNextPending = 0;
+            continue;
+        }
+        if(hasWrapped && firstVisited && object->next >= firstVisited) {
+            return 0;
+        }
+        if(!hasWrapped && !firstVisited) {
+            firstVisited = object->next;
+        }
+        object->isNextPending = 1;
+        if(text.data[object->next] != '"') {
+            object->isNextPending = 0;
+            object->next = text.count;
+            return 0;
+        }
+        u64 labelEnd = skipRawString(text, object->next);
+        Buffer label = {
+            .data = text.data + object->next + 1,
+            .count = (labelEnd > object->next + 1) ?
+                labelEnd - object->next - 2 : 0,
+        };
+        u64 colon = skipRawSpaces(text, labelEnd);
+        if(colon >= text.count || text.data[colon] != ':') {
+            object->isNextPending = 0;
+            object->next = text.count;
+            return 0;
+        }
+        if(areEqual(label, key.label)) {
+            *value = (json_Cursor){
+                .text = text,
+                .offset = skipRawSpaces(text, colon + 1),
+            };
+            return 1;
+        }
+    }
+}
+
+// Returns the contents of the string without the quotes, escapes are kept as
+// they are. The result is empty if the value isn't a string.
+Buffer
+json_getString(json_Cursor value)
+{
+    Buffer result = {0};
+    Buffer text = value.text;
+    if(value.offset < text.count && text.data[value.offset] == '"') {
+        // the text can't end with a string if it's valid
+        u64 end = skipRawString(text, value.offset);
+        if(end < text.count) {
+            result.data = text.data + value.offset + 1;
+            result.count = end - value.offset - 2;
+        }
+    }
+    return result;
+}
+
+// Returns 0 if the value isn't a non negative integer that fits in a u64
+u64
+json_getU64(json_Cursor value)
+{
+    Buffer text = value.text;
+    u64 result = 0;
+    u64 offset = value.offset;
+    for(; offset < text.count && isNumeric((char)text.data[offset]); ++offset) {
+        u64 digit = text.data[offset] - '0';
+        if(result > (UINT64_MAX - digit) / 10) {
+            return 0;
+        }
+        result = 10*result + digit;
+    }
+    if(offset == value.offset ||
+            (offset < text.count && !isSeparator((char)text.data[offset]))) {
+        return 0;
+    }
+    return result;
+}
+
+// String decoding
+//
+// Strings are kept with their escapes in tapes and cursors, and decoded only
+// when they're copied out. Most strings have no escapes and are plain ASCII,
+// so runs without '\\' or bytes above 0x7f are found with vector compares and
+// copied whole. Escapes and multi-byte UTF-8 sequences are handled one at a
+// time in between those runs.
+
+// Returns the offset of the first '\\' or non ASCII byte in data, or count if
+// there's none.
+static u64
+findBackslashOrNonAscii(u8 const *data, u64 count)
+{
+    u64 i = 0;
+#if defined(VECTOR_SIZE)
+    for(; i + VECTOR_SIZE <= count; i += VECTOR_SIZE) {
+        Vector v = loadVector(data + i);
+        // the mask of v itself is the top bit of every byte
+        u64 mask = vectorToMask(vectorOr(v, vectorEquals(v, '\\')));
+        if(mask) {
+            return i + __builtin_ctzll(mask);
+        }
+    }
+#endif
+    for(; i < count; ++i) {
+        if(data[i] == '\\' || data[i] >= 0x80) {
+            break;
+        }
+    }
+    return i;
+}
+
+static s32
+readHexDigit(u8 ch)
+{
+    if(ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    ch |= 0x20;
+    if(ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    return -1;
+}
+
+// Reads the 4 hex digits of a \u escape, returns -1 if they're not valid
+static s32
+readEscapedCodeUnit(u8 const *data, u64 count)
+{
+    if(count < 4) {
+        return -1;
+    }
+    s32 codeUnit = 0;
+    for(u64 i = 0; i < 4; ++i) {
+        s32 digit = readHexDigit(data[i]);
+        if(digit < 0) {
+            return -1;
+        }
+        codeUnit = 16*codeUnit + digit;
+    }
+    return codeUnit;
+}
+
+static u64
+writeUtf8(u8 *out, u32 codePoint)
+{
+    if(codePoint < 0x80) {
+        out[0] = (u8)codePoint;
+        return 1;
+    }
+    if(codePoint < 0x800) {
+        out[0] = (u8)(0xc0 | (codePoint >> 6));
+        out[1] = (u8)(0x80 | (codePoint & 0x3f));
+        return 2;
+    }
+    if(codePoint < 0x10000) {
+        out[0] = (u8)(0xe0 | (codePoint >> 12));
+        out[1] = (u8)(0x80 | ((codePoint >> 6) & 0x3f));
+        out[2] = (u8)(0x80 | (codePoint & 0x3f));
+        return 3;
+    }
+    out[0] = (u8)(0xf0 | (codePoint >> 18));
+    out[1] = (u8)(0x80 | ((codePoint >> 12) & 0x3f));
+    out[2] = (u8)(0x80 | ((codePoint >> 6) & 0x3f));
+    out[3] = (u8)(0x80 | (codePoint & 0x3f));
+    return 4;
+}
+
+// Decodes the escape that starts at data[0], which is a '\\'. Returns how many
+// bytes of data it took, or 0 if it isn't valid.
+static u64
+decodeEscape(u8 const *data, u64 count, u8 *out, u64 *outCount)
+{
+    if(count < 2) {
+        return 0;
+    }
+    u8 decoded = 0;
+    switch(data[1]) {
+        case '"':  decoded = '"'; break;
+        case '\\': decoded = '\\'; break;
+        case '/':  decoded = '/'; break;
+        case 'b':  decoded = '\b'; break;
+        case 'f':  decoded = '\f'; break;
+        case 'n':  decoded = '\n'; break;
+        case 'r':  decoded = '\r'; break;
+        case 't':  decoded = '\t'; break;
+        case 'u':
+        {
+            s32 codeUnit = readEscapedCodeUnit(data + 2, count - 2);
+            if(codeUnit < 0 || (codeUnit >= 0xdc00 && codeUnit <= 0xdfff)) {
+                return 0;
+            }
+            if(codeUnit < 0xd800 || codeUnit > 0xdbff) {
+                *outCount += writeUtf8(out + *outCount, (u32)codeUnit);
+                return 6;
+            }
+            // characters outside of the BMP come as a pair of surrogates
+            if(count < 12 || data[6] != '\\' || data[7] != 'u') {
+                return 0;
+            }
+            s32 low = readEscapedCodeUnit(data + 8, count - 8);
+            if(low < 0xdc00 || low > 0xdfff) {
+                return 0;
+            }
+            u32 codePoint =
+                0x10000 + (((u32)codeUnit - 0xd800) << 10) + ((u32)low - 0xdc00);
+            *outCount += writeUtf8(out + *outCount, codePoint);
+            return 12;
+        }
+        default: return 0;
+    }
+    out[(*outCount)++] = decoded;
+    return 2;
+}
+
+// Returns the length of the UTF-8 sequence at data[0], or 0 if it isn't a
+// valid one. Overlong forms, surrogates and code points above U+10FFFF are
+// rejected.
+static u64
+validateUtf8Sequence(u8 const *data, u64 count)
+{
+    u8 lead = data[0];
+    u64 length = 0;
+    u32 codePoint = 0;
+    u32 minCodePoint = 0;
+    if(lead < 0x80) {
+        return 1;
+    }
+    else if((lead & 0xe0) == 0xc0) {
+        length = 2;
+        codePoint = lead & 0x1f;
+        minCodePoint = 0x80;
+    }
+    else if((lead & 0xf0) == 0xe0) {
+        length = 3;
+        codePoint = lead & 0x0f;
+        minCodePoint = 0x800;
+    }
+    else if((lead & 0xf8) == 0xf0) {
+        length = 4;
+        codePoint = lead & 0x07;
+        minCodePoint = 0x10000;
+    }
+    if(!length || length > count) {
+        return 0;
+    }
+    for(u64 i = 1; i < length; ++i) {
+        if((data[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        codePoint = (codePoint << 6) | (data[i] & 0x3f);
+    }
+    b32 isSurrogate = (codePoint >= 0xd800 && codePoint <= 0xdfff);
+    if(codePoint < minCodePoint || codePoint > 0x10ffff || isSurrogate) {
+        return 0;
+    }
+    return length;
+}
+
+// Pushes the contents of a JSON string, without the quotes, with all of its
+// escapes decoded. On an invalid escape or invalid UTF-8 nothing is pushed and
+// the returned buffer has no data.
+Buffer
+json_decodeString(MemoryArena *arena, Buffer string)
+{
+    // decoding never makes a string longer
+    u8 *out = pushArray(arena, string.count, u8);
+    check(out);
+    u8 const *in = string.data;
+    u64 inCount = 0;
+    u64 outCount = 0;
+    while(inCount < string.count) {
+        u64 run = findBackslashOrNonAscii(in + inCount, string.count - inCount);
+        if(run) {
+            memcpy(out + outCount, in + inCount, run);
+            inCount += run;
+            outCount += run;
+        }
+        if(inCount >= string.count) {
+            break;
+        }
+        u64 taken = 0;
+        if(in[inCount] == '\\') {
+            taken = decodeEscape(
+                    in + inCount, string.count - inCount, out, &outCount);
+        }
+        else {
+            // non ASCII text tends to come in long runs, read the whole run
+            // before going back to the vector search
+            u64 sequence = 0;
+            do {
+                sequence = validateUtf8Sequence(in + inCount + taken,
+                        string.count - inCount - taken);
+                taken += sequence;
+            } while(sequence && inCount + taken < string.count &&
+                    in[inCount + taken] >= 0x80);
+            taken = sequence ? taken : 0;
+            memcpy(out + outCount, in + inCount, taken);
+            outCount += taken;
+        }
+        if(!taken) {
+            popFromMemoryArena(arena, string.count);
+            return (Buffer){0};
+        }
+        inCount += taken;
+    }
+    popFromMemoryArena(arena, string.count - outCount);
+    Buffer decoded = {.data = out, .count = outCount};
+    return decoded;
+}
+
+f64
+json_getNumber(json_Element element)
+{
+    f64 result = 0;
+    if(element.type == json_NUMBER) {
+        json_TapeEntry const *value = element.entry + 1;
+        result = value->isInteger ? (f64)value->integer : value->real;
+    }
+    return result;
+}
+
+// Numbers with a fractional part are truncated, and the ones out of the s64
+// range give 0
+s64
+json_getInteger(json_Element element)
+{
+    s64 result = 0;
+    if(element.type == json_NUMBER) {
+        json_TapeEntry const *value = element.entry + 1;
+        if(value->isInteger) {
+            result = value->integer;
+        }
+        else if(value->real > -9.2e18 && value->real < 9.2e18) {
+            result = (s64)value->real;
+        }
+    }
+    return result;
+}
+
+json_Element
+json_getFirstSubElement(json_Element list)
+{
+    json_Element element = {0};
+    if(list.type == json_ARRAY || list.type == json_OBJECT) {
+        element = makeElement(getFirstListItemEntry(list.entry),
+                list.entry + list.entry->span);
+    }
+    return element;
+}
+
+json_Element
+json_getNextSibling(json_Element element)
+{
+    json_Element sibling = {0};
+    if(element.type) {
+        json_TapeEntry const *next =
+            element.entry + getTapeEntrySpan(element.entry);
+        sibling = makeElement(next, element.listEnd);
+    }
+    return sibling;
+}
+
+u64
+json_getArrayCount(json_Element array)
+{
+    u64 count = 0;
+    if(array.type == json_ARRAY) {
+        count = array.entry->count;
+    }
+    return count;
+}
+
+json_Element
+json_getElementByKey(json_Element element, json_Key key)
+{
+    if(element.type == json_OBJECT && key.label.data) {
+        json_TapeEntry const *object = element.entry;
+        json_TapeEntry const *index = object + 1;
+        json_TapeEntry const *end = object + object->span;
+        if(index->count) {
+            u32 const *slots = (u32 const*)index->data;
+            u32 mask = index->count - 1;
+            for(u32 i = key.hash & mask; slots[i]; i = (i + 1) & mask) {
+                json_TapeEntry const *label = object + slots[i];
+                if(isLabelEntryEqual(label, key)) {
+                    return makeElement(label, end);
+                }
+            }
+        }
+        else {
+            for(json_TapeEntry const *label = getFirstListItemEntry(object);
+                    label < end;
+                    label += 1 + getTapeEntrySpan(label + 1)) {
+                if(isLabelEntryEqual(label, key)) {
+                    return makeElement(label, end);
+                }
+            }
+        }
+    }
+    return (json_Element){0};
+}
+
+json_Element
+json_getElement(json_Element element, Buffer label)
+{
+    return json_getElementByKey(element, json_makeKey(label));
+}
+
+// Prints element and the siblings that come after it. Lists nested deeper
+// than JSON_MAX_DEPTH below element are printed as "..." and make it return 0.
+b32
+json_printElement(json_Element element)
+{
+    json_Element openLists[JSON_MAX_DEPTH];
+    u64 depth = 0;
+    b32 isComplete = 1;
+    for(;;) {
+        if(!element.type) {
+            if(!depth) {
+                break;
+            }
+            element = openLists[--depth];
+            printf((element.type == json_ARRAY) ? "]\n" : "}\n");
+            element = json_getNextSibling(element);
+            continue;
+        }
+        printBuffer(element.label);
+        printf(":");
+        switch(element.type) {
+            case json_INVALID_ELEMENT: break;
+            case json_LABEL: break;
+            case json_OBJECT_INDEX: break;
+            case json_NUMBER_VALUE: break;
+            case json_TRUE: printf("true"); break;
+            case json_FALSE: printf("false");break;
+            case json_NULL: printf("null"); break;
+            case json_NUMBER: printf("%f", json_getNumber(element)); break;
+            case json_STRING: printBuffer(element.value); break;
+            case json_ARRAY: printf("["); break;
+            case json_OBJECT: printf("{"); break;
+        }
+
+        b32 isList = (element.type == json_ARRAY || element.type == json_OBJECT);
+        if(isList && depth < JSON_MAX_DEPTH) {
+            printf("\n");
+            openLists[depth++] = element;
+            element = json_getFirstSubElement(element);
+        }
+        else {
+            if(isList) {
+                printf((element.type == json_ARRAY) ? "...]" : "...}");
+                if(isComplete) {
+                    fprintf(stderr, "JSON ERROR: lists are nested too deeply "
+                            "to be printed\n");
+                }
+                isComplete = 0;
+            }
+            printf("\n");
+            element = json_getNextSibling(element);
         }
-        element = element->nextSibling;
     }
+    return isComplete;
 }
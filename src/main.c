@@ -10,26 +10,143 @@
 #include <curl/curl.h>
 #include "config.c"
 
+// On linux the transfers are driven by epoll, libcurl tells us which sockets
+// to watch and when its timer expires. Elsewhere curl_multi_poll does the
+// waiting.
+#if defined(__linux__)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#else
+#define USE_EPOLL 0
+#endif
+
+// test/test.sh points these to a local stand-in for spotify
+#ifndef ACCOUNTS_ORIGIN
+#define ACCOUNTS_ORIGIN "https://accounts.spotify.com"
+#endif
+#ifndef API_ORIGIN
+#define API_ORIGIN "https://api.spotify.com"
+#endif
+// test/tls.sh also defines CA_CERTIFICATE_PATH, so its stand-in's self-signed
+// certificate is trusted
 #define \
-AUTHORIZATION_CODE_ACCESS_URI "https://accounts.spotify.com/authorize?client_id="CLIENT_ID"&response_type=code&redirect_uri="REDIRECT_URI"&scope=playlist-read-collaborative"
+AUTHORIZATION_CODE_ACCESS_URI ACCOUNTS_ORIGIN"/authorize?client_id="CLIENT_ID"&response_type=code&redirect_uri="REDIRECT_URI"&scope=playlist-read-collaborative"
 #define \
-TOKEN_URI "https://accounts.spotify.com/api/token/"
+TOKEN_URI ACCOUNTS_ORIGIN"/api/token/"
 #define \
-PLAYLIST_URI "https://api.spotify.com/v1/playlists/"
+PLAYLIST_URI API_ORIGIN"/v1/playlists/"
 #define \
-PLAYLIST_LIST_URI "https://api.spotify.com/v1/me/playlists/"
+PLAYLIST_LIST_URI API_ORIGIN"/v1/me/playlists"
+// the most playlists and tracks spotify sends in a page
+#define \
+PLAYLIST_PAGE_LIMIT 50
+#define \
+TRACK_PAGE_LIMIT 100
 #define \
 OK_RESPONSE 200
 #define \
 EXPIRED_TOKEN_RESPONSE 401
 #define \
-CONNECTION_COUNT 128
+TOO_MANY_REQUESTS_RESPONSE 429
+// How many requests may be in flight at once. The limit starts at
+// MIN_CONNECTION_COUNT and moves between the two with the observed latency,
+// throughput and 429s, easy handles are only created when it grows.
+#ifndef MIN_CONNECTION_COUNT
+#define MIN_CONNECTION_COUNT 4
+#endif
+#ifndef MAX_CONNECTION_COUNT
+#define MAX_CONNECTION_COUNT 128
+#endif
+// Requests to the same host are multiplexed over HTTP/2 connections, up to
+// MAX_STREAM_COUNT on each. Hosts that only speak HTTP/1.1 get a connection per
+// request, up to MAX_HOST_CONNECTION_COUNT.
+#ifndef MAX_HOST_CONNECTION_COUNT
+#define MAX_HOST_CONNECTION_COUNT MAX_CONNECTION_COUNT
+#endif
+#ifndef MAX_STREAM_COUNT
+#define MAX_STREAM_COUNT 100
+#endif
+// the limit grows by this much per round of requests, once out of slow start
+#define \
+CONCURRENCY_INCREASE 1.0
+// and is multiplied by this on congestion
+#define \
+CONCURRENCY_DECREASE 0.5
+// a round is congested when its mean latency is this many times the lowest
+// latency seen and the throughput didn't go up
+#define \
+LATENCY_TOLERANCE 2.0
+#define \
+EPOLL_EVENT_COUNT 64
+// how long the loop sleeps when libcurl has no timer set
+#define \
+IDLE_WAIT_MS 1000
+#define \
+NO_TIMER ((u64)-1)
+// the access token is renewed this long before it expires, or halfway through
+// its life if that's shorter
+#define \
+TOKEN_RENEWAL_MARGIN_SECONDS 300
+// Requests start at most at MAX_REQUEST_RATE per second, in bursts of up to
+// REQUEST_BURST_COUNT. Every 429 halves the rate, down to MIN_REQUEST_RATE,
+// and each request that goes through brings it back up by
+// REQUEST_RATE_RECOVERY.
+#ifndef MAX_REQUEST_RATE
+#define MAX_REQUEST_RATE 100.0
+#endif
+#define \
+MIN_REQUEST_RATE 1.0
+#define \
+REQUEST_RATE_RECOVERY 0.5
+#define \
+REQUEST_BURST_COUNT 128.0
+// how long requests wait after a 429 that doesn't say it
+#define \
+DEFAULT_RETRY_AFTER_SECONDS 1
+
+// Records the playlists saved by the last run, the ones whose snapshot didn't
+// change since then keep their files and aren't downloaded again
+#ifndef MANIFEST_PATH
+#define MANIFEST_PATH "myspotifypl-manifest.json"
+#endif
+// at least twice as many slots as entries, rounded up to a power of two
+#define \
+MIN_MANIFEST_SLOT_COUNT 16
 
 #define MEGABYTE (1ull << 20)
 
+// Requests are only started while the responses in flight fit in this budget.
+// A response counts as its Content-Length, or as DEFAULT_RESPONSE_BYTE_COUNT
+// until its headers arrive and when it's compressed, since its decoded size
+// isn't known then.
+#ifndef RESPONSE_BYTE_BUDGET
+#define RESPONSE_BYTE_BUDGET (64*MEGABYTE)
+#endif
+#define \
+DEFAULT_RESPONSE_BYTE_COUNT (256*1024)
+// arenas that hold a response's parsed values start with this many bytes, and
+// can't grow past the reserved count
+#define \
+RESPONSE_ARENA_BYTE_COUNT (64*1024)
+#define \
+RESPONSE_ARENA_RESERVED_BYTE_COUNT (1ull << 30)
+// the queue starts with this many jobs and doubles when it's full
+#define \
+JOB_QUEUE_COUNT 1024
+#define \
+JOB_QUEUE_RESERVED_BYTE_COUNT (1ull << 30)
+// the same goes for the arenas of the playlists being read
+#define \
+PLAYLIST_ARENA_BYTE_COUNT (64*1024)
+#define \
+PLAYLIST_ARENA_RESERVED_BYTE_COUNT (1ull << 30)
+
 #define \
 CS(str) CONSTANT_STRING(str)
 
+#define \
+ARRAY_COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
 #define \
 errorAndTerminate(format, ...) \
 ({ \
@@ -45,41 +162,71 @@ printWarning(format, ...) \
     check(0); \
 })
 
-typedef struct Track {
-    Buffer title;
-    Buffer album;
-    Buffer dateAdded;
-    u64 durationInMs;
-    Buffer *artistArray;
-    u64 artistCount;
-} Track;
-
 typedef struct Playlist {
+    // holds the rows of the pages, it's borrowed when the first page arrives
+    // and returned to the pool as soon as the playlist's file is written
+    MemoryArena arena;
     Buffer name;
-    Track *trackArray;
+    Buffer id;
+    Buffer snapshotId;
     u64 trackCount;
-    u64 filledTrackCount;
+    // CSV rows of each page of tracks, in the order of the pages
+    Buffer *pageRowsArray;
+    u64 pageCount;
+    u64 filledPageCount;
+    // its file is up to date, it goes in the manifest
+    b32 isSaved;
+    // it didn't change since the manifest was written, its file is kept
+    b32 isKept;
+    // another playlist has the same name, so both write the same file
+    b32 sharesFile;
 } Playlist;
 
 typedef struct PlaylistArray {
     Playlist *data;
     u64 count;
+    // open addressing table of the playlists read so far, by the hash of
+    // their names. Slots hold the playlist index plus one, 0 when empty.
+    u64 *nameSlotArray;
+    u64 nameSlotCount;
 } PlaylistArray;
 
+// A playlist as the last run saved it, the strings are kept as they are in the
+// JSON text
+typedef struct ManifestEntry {
+    Buffer playlistId;
+    Buffer snapshotId;
+    u64 trackCount;
+    Buffer fileName;
+} ManifestEntry;
+
+// Open addressing table of the entries, by the hash of their playlist ids
+typedef struct Manifest {
+    ManifestEntry *slotArray;
+    u64 slotCount;
+} Manifest;
+
 typedef enum JobType {
     Job_zero,
     Job_playlistListHeader,
     Job_playlistList,
-    Job_playlistHeader,
     Job_trackList,
+    Job_typeCount,
 } JobType;
 
+// The URI of a job is only built when its request is sent, from its type,
+// offset and playlist id
 typedef struct Job {
     JobType type;
-    Buffer uri;
+    // points to the playlist's own id, for pages of tracks
+    Buffer playlistId;
     json_Element json;
+    // CSV rows written while the response was parsed, for pages of tracks
+    Buffer csvRows;
     u64 playlistIndex;
     u64 offset;
+    // the access token the request was sent with
+    u64 tokenGeneration;
 } Job;
 
 typedef struct JobQueue {
@@ -88,51 +235,182 @@ typedef struct JobQueue {
     u64 count;
     u64 first;
     u64 last;
-    MemoryArena *arena;
+    // holds nothing but the jobs, so they can grow in place
+    MemoryArena arena;
 } JobQueue;
 
+// Token bucket that paces the requests, and holds them all back while spotify
+// asks to
+typedef struct RateLimiter {
+    f64 rate;
+    f64 tokenCount;
+    u64 lastRefillTime;
+    u64 pausedUntil;
+    u64 startTime;
+    u64 completedRequestCount;
+    u64 throttledRequestCount;
+} RateLimiter;
+
+// What's known about a response while it arrives
+typedef struct Response {
+    json_StreamParser *parser;
+    // what the request takes from RESPONSE_BYTE_BUDGET
+    u64 budgetByteCount;
+    b32 isEncoded;
+    // bytes fed to the parser, after libcurl decompressed them
+    u64 decodedByteCount;
+} Response;
+
+// Additive increase, multiplicative decrease of the number of requests in
+// flight. Like TCP, it doubles every round during slow start, until the first
+// congestion.
+typedef struct ConcurrencyController {
+    f64 limit;
+    b32 isSlowStart;
+    // a round is over when as many requests as the limit are
+    u64 roundStartTime;
+    u64 roundRequestCount;
+    u64 roundSuccessCount;
+    u64 roundLatencySum;
+    b32 isRoundCongested;
+    f64 lastThroughput;
+    // in microseconds
+    u64 minLatency;
+    u64 decreaseCount;
+} ConcurrencyController;
+
 typedef struct NetworkState {
     CURLM *multiHandle;
+    // DNS, TLS sessions and connections, for all easy handles
+    CURLSH *share;
     u64 easyHandleCount;
     CURL **easyHandleArray;
     Job *handleToJobMap;
+    // the arenas of busy handles are borrowed from responseArenaPool, except
+    // for handle 0's, which is only used for tokens
+    ArenaPool responseArenaPool;
     MemoryArena *handleToArenaMap;
+    MemoryArena *handleToTapeArenaMap;
+    MemoryArena *handleToCsvArenaMap;
+    Response *handleToResponseMap;
+    json_StreamParser *handleToParserMap;
+    json_Projection jobTypeToProjectionMap[Job_typeCount];
+    // the same projections, in the form of spotify's "fields" parameter
+    Buffer jobTypeToFieldsMap[Job_typeCount];
     b32 *busyHandleFlagArray;
     u64 busyHandleCount;
+    // transfers libcurl hasn't finished, the busy handles past it are done
+    // and wait for processFinishedRequests
+    int runningHandleCount;
+#if USE_EPOLL
+    int epollFd;
+    // when libcurl's timer expires, in getNanoseconds time
+    u64 timerDeadline;
+#endif
     Buffer accessToken;
     Buffer refreshToken;
+    // bumped every time the access token changes
+    u64 tokenGeneration;
+    // when the token should be renewed, in getNanoseconds time
+    u64 tokenRenewalDeadline;
+    // handle 0 is renewing the token
+    b32 isRenewingToken;
+    // spotify refused the token, no request starts until it's renewed
+    b32 isTokenRejected;
+    RateLimiter rateLimiter;
+    ConcurrencyController concurrency;
+    // response bodies of the whole run, as received and after decompression,
+    // and the part of them that came compressed
+    u64 wireByteCount;
+    u64 decodedByteCount;
+    u64 encodedWireByteCount;
+    u64 encodedDecodedByteCount;
+    u64 encodedResponseCount;
+    u64 responseCount;
+    // connections the API requests had to open, and how long they waited for
+    // the first byte of their response
+    u64 newConnectionCount;
+    u64 firstByteMicroseconds;
+    u64 firstByteTotalMicroseconds;
+    u64 firstByteRequestCount;
 } NetworkState;
 
 typedef struct AppMemory {
-    MemoryArena curlBuffer;
     MemoryArena persistent;
     MemoryArena scratch;
+    // only the current tokens, the old ones are dropped when they're renewed
+    MemoryArena tokens;
+    ArenaPool playlistArenaPool;
 } AppMemory;
 
 typedef struct State {
     JobQueue jobQueue;
     PlaylistArray playlistArray;
+    Manifest manifest;
     AppMemory memory;
     NetworkState networkState;
 } State;
 
+// Labels of the fields read from spotify's responses, hashed once at startup
+typedef struct JsonKeys {
+    json_Key accessToken;
+    json_Key refreshToken;
+    json_Key expiresIn;
+    json_Key items;
+    json_Key track;
+    json_Key name;
+    json_Key album;
+    json_Key artists;
+    json_Key addedAt;
+    json_Key durationMs;
+    json_Key id;
+    json_Key total;
+    json_Key limit;
+    json_Key tracks;
+    json_Key snapshotId;
+    json_Key playlists;
+    json_Key trackCount;
+    json_Key file;
+} JsonKeys;
+
+static JsonKeys jsonKeys;
+
+static void
+initJsonKeys(JsonKeys *keys)
+{
+    keys->accessToken = json_makeKey(CS("access_token"));
+    keys->refreshToken = json_makeKey(CS("refresh_token"));
+    keys->expiresIn = json_makeKey(CS("expires_in"));
+    keys->items = json_makeKey(CS("items"));
+    keys->track = json_makeKey(CS("track"));
+    keys->name = json_makeKey(CS("name"));
+    keys->album = json_makeKey(CS("album"));
+    keys->artists = json_makeKey(CS("artists"));
+    keys->addedAt = json_makeKey(CS("added_at"));
+    keys->durationMs = json_makeKey(CS("duration_ms"));
+    keys->id = json_makeKey(CS("id"));
+    keys->total = json_makeKey(CS("total"));
+    keys->limit = json_makeKey(CS("limit"));
+    keys->tracks = json_makeKey(CS("tracks"));
+    keys->snapshotId = json_makeKey(CS("snapshot_id"));
+    keys->playlists = json_makeKey(CS("playlists"));
+    keys->trackCount = json_makeKey(CS("track_count"));
+    keys->file = json_makeKey(CS("file"));
+}
+
+// The jobs are the top of the queue's arena, so the array grows in place and
+// only the ones that wrapped around are moved, right after the others
 static void
 growJobQueue(JobQueue *jq)
 {
-    u64 newMaxCount = 2 * jq->maxCount;
-    Job *newData = pushArray(jq->arena, newMaxCount, Job);
-    check(newData);
-    u64 newQueueIndex = 0;
-    for(u64 i = jq->first, count = 0; count < jq->count; ++i, ++count) {
-        if(i >= jq->maxCount) {
-            i = 0;
-        }
-        newData[newQueueIndex++] = jq->data[i];
+    u64 oldMaxCount = jq->maxCount;
+    Job *tail = pushArray(&jq->arena, oldMaxCount, Job);
+    check(tail == jq->data + oldMaxCount);
+    if(jq->count && jq->last <= jq->first) {
+        memcpy(tail, jq->data, jq->last*sizeof(Job));
+        jq->last += oldMaxCount;
     }
-    jq->first = 0;
-    jq->last = newQueueIndex;
-    jq->data = newData;
-    jq->maxCount = newMaxCount;
+    jq->maxCount = 2*oldMaxCount;
 }
 
 static void
@@ -147,6 +425,21 @@ enqueueJob(JobQueue *jq, Job job)
     jq->count += 1;
 }
 
+// Puts a job that was already taken from the queue back at its front, so a
+// refused page goes out again before pages of playlists that haven't started
+// and its playlist's arena isn't held until the whole queue drains
+static void
+requeueJob(JobQueue *jq, Job job)
+{
+    b32 queueIsFull = jq->count + 1 > jq->maxCount;
+    if(queueIsFull) {
+        growJobQueue(jq);
+    }
+    jq->first = (jq->first + jq->maxCount - 1) % jq->maxCount;
+    jq->data[jq->first] = job;
+    jq->count += 1;
+}
+
 static Job
 dequeueJob(JobQueue *jq)
 {
@@ -161,11 +454,13 @@ dequeueJob(JobQueue *jq)
 }
 
 static void
-initJobQueue(JobQueue *queue, u64 count, MemoryArena *arena)
+initJobQueue(JobQueue *queue, u64 count)
 {
-    queue->data = pushArray(arena, count, Job);
+    queue->arena = allocateMemoryArenaInReserve(
+            count*sizeof(Job), JOB_QUEUE_RESERVED_BYTE_COUNT);
+    nameMemoryArena(&queue->arena, "job queue");
+    queue->data = pushArray(&queue->arena, count, Job);
     queue->maxCount = count;
-    queue->arena = arena;
 }
 
 static b32
@@ -177,15 +472,35 @@ isJobQueueEmpty(JobQueue const *jq)
 static void
 deinit(State *st)
 {
-    // deinit libcurl
+    NetworkState *nst = &st->networkState;
+    // deinit libcurl, the easy handles use the share, so they go before it
     {
+        for(u64 i = 0; i < nst->easyHandleCount; ++i) {
+            curl_multi_remove_handle(nst->multiHandle,
+                    nst->easyHandleArray[i]);
+        }
+        curl_multi_cleanup(nst->multiHandle);
+        for(u64 i = 0; i < nst->easyHandleCount; ++i) {
+            curl_easy_cleanup(nst->easyHandleArray[i]);
+        }
+        CURLSHcode code = curl_share_cleanup(nst->share);
+        check(!code && "a handle still uses the share");
+#if USE_EPOLL
+        // closing the multi handle's sockets goes through the epoll instance
+        close(nst->epollFd);
+#endif
         curl_global_cleanup();
     }
     for(u64 i = 0; i < st->playlistArray.count; ++i) {
         Playlist playlist = st->playlistArray.data[i];
-        check(playlist.filledTrackCount == playlist.trackCount);
+        check(playlist.filledPageCount == playlist.pageCount);
     }
-    freeMemoryArena(&st->memory.curlBuffer);
+    reportArenaStats();
+    freeArenaPool(&st->networkState.responseArenaPool);
+    freeMemoryArena(&st->networkState.handleToArenaMap[0]);
+    freeArenaPool(&st->memory.playlistArenaPool);
+    freeMemoryArena(&st->memory.tokens);
+    freeMemoryArena(&st->jobQueue.arena);
     freeMemoryArena(&st->memory.persistent);
     freeMemoryArena(&st->memory.scratch);
 }
@@ -202,6 +517,109 @@ writeDataLibcurlCallback(void *buffer, u64 membsize, u64 nmemb, void *userp)
     return writeCount;
 }
 
+// libcurl has already decompressed the data
+static u64
+parseDataLibcurlCallback(void *buffer, u64 membsize, u64 nmemb, void *userp)
+{
+    Response *response = (Response*)userp;
+    u64 writeCount = membsize*nmemb;
+    Buffer chunk = {.data = (u8*)buffer, .count = writeCount};
+    // errors are reported once the transfer is done, by json_endStream
+    json_feedStream(response->parser, chunk);
+    response->decodedByteCount += writeCount;
+    return writeCount;
+}
+
+// name is lowercase and ends with the colon
+static b32
+isHeader(Buffer header, Buffer name)
+{
+    b32 result = (header.count > name.count);
+    for(u64 i = 0; result && i < name.count; ++i) {
+        u8 ch = header.data[i];
+        ch = (ch >= 'A' && ch <= 'Z') ? (u8)(ch - 'A' + 'a') : ch;
+        result = (ch == name.data[i]);
+    }
+    return result;
+}
+
+// Whether the value of a Content-Encoding header lists a compression, which
+// libcurl undoes. "identity" leaves the body as it is.
+static b32
+isCompressedEncoding(Buffer value)
+{
+    Buffer const compressionArray[] = {
+        CS("gzip"), CS("x-gzip"), CS("deflate"), CS("br"), CS("zstd"),
+    };
+    u64 offset = 0;
+    while(offset < value.count) {
+        // codings are separated by commas and spaces, the value ends with
+        // the header's CRLF
+        u64 start = offset;
+        while(offset < value.count && value.data[offset] != ',' &&
+                value.data[offset] != ' ' && value.data[offset] != '\t' &&
+                value.data[offset] != '\r' && value.data[offset] != '\n') {
+            offset += 1;
+        }
+        u64 codingCount = offset - start;
+        for(u64 i = 0; i < sizeof(compressionArray)/sizeof(Buffer); ++i) {
+            Buffer compression = compressionArray[i];
+            b32 isEqual = (codingCount == compression.count);
+            for(u64 j = 0; isEqual && j < codingCount; ++j) {
+                u8 ch = value.data[start + j];
+                ch = (ch >= 'A' && ch <= 'Z') ? (u8)(ch - 'A' + 'a') : ch;
+                isEqual = (ch == compression.data[j]);
+            }
+            if(isEqual) {
+                return 1;
+            }
+        }
+        offset += (offset < value.count) ? 1 : 0;
+    }
+    return 0;
+}
+
+// Keeps the response's Content-Length as the byte count the request takes
+// from RESPONSE_BYTE_BUDGET, unless the response is compressed
+static u64
+readHeaderLibcurlCallback(void *buffer, u64 membsize, u64 nmemb, void *userp)
+{
+    Response *response = (Response*)userp;
+    u64 readCount = membsize*nmemb;
+    Buffer header = {.data = (u8*)buffer, .count = readCount};
+    Buffer name = CS("content-length:");
+    Buffer encodingName = CS("content-encoding:");
+    if(isHeader(header, encodingName)) {
+        Buffer value = {
+            .data = header.data + encodingName.count,
+            .count = header.count - encodingName.count,
+        };
+        if(isCompressedEncoding(value)) {
+            response->isEncoded = 1;
+            response->budgetByteCount = DEFAULT_RESPONSE_BYTE_COUNT;
+        }
+    }
+    else if(isHeader(header, name) && !response->isEncoded) {
+        u64 offset = name.count;
+        while(offset < header.count && header.data[offset] == ' ') {
+            offset += 1;
+        }
+        u64 byteCount = 0;
+        u64 digitCount = 0;
+        while(offset < header.count &&
+                header.data[offset] >= '0' && header.data[offset] <= '9' &&
+                digitCount < 18) {
+            byteCount = 10*byteCount + (header.data[offset] - '0');
+            offset += 1;
+            digitCount += 1;
+        }
+        if(digitCount) {
+            response->budgetByteCount = byteCount;
+        }
+    }
+    return readCount;
+}
+
 static void
 initLibcurl(State *st)
 {
@@ -220,15 +638,22 @@ clearCurlBufferAndSendRequest(CURL *handle, MemoryArena *handleArena)
 }
 
 static void
-httpPostToken(CURL *handle, MemoryArena *handleArena, Buffer postStr)
+configureTokenRequest(CURL *handle, MemoryArena *handleArena, Buffer postStr)
 {
-    curl_easy_setopt(handle,CURLOPT_POSTFIELDS, postStr.data);
+    // libcurl keeps its own copy of the post
+    curl_easy_setopt(handle, CURLOPT_COPYPOSTFIELDS, postStr.data);
     curl_easy_setopt(handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
     curl_easy_setopt(handle, CURLOPT_USERPWD, CLIENT_ID":"CLIENT_SECRET);
     curl_easy_setopt(handle, CURLOPT_URL, TOKEN_URI);
     curl_easy_setopt(handle, CURLOPT_VERBOSE, 0);
     curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeDataLibcurlCallback);
     curl_easy_setopt(handle, CURLOPT_WRITEDATA, handleArena);
+}
+
+static void
+httpPostToken(CURL *handle, MemoryArena *handleArena, Buffer postStr)
+{
+    configureTokenRequest(handle, handleArena, postStr);
     clearCurlBufferAndSendRequest(handle, handleArena);
 
     long responseCode = 0;
@@ -271,9 +696,9 @@ pushBufferAsCString(MemoryArena *arena, Buffer buf)
 }
 
 static Buffer
-copyString(MemoryArena *arena, json_Element element, Buffer fieldName)
+copyString(MemoryArena *arena, json_Element element, json_Key field)
 {
-    json_Element strElement = json_getElement(element, fieldName);
+    json_Element strElement = json_getElementByKey(element, field);
     check(strElement.type == json_STRING ||
             strElement.type == json_INVALID_ELEMENT);
     Buffer newBuf = {0};
@@ -283,63 +708,94 @@ copyString(MemoryArena *arena, json_Element element, Buffer fieldName)
     return newBuf;
 }
 
+// Decodes the string's escapes, and escapes its quotes for a CSV field by
+// doubling them
 static Buffer
 copyStringAndEscapeCommas(
-        MemoryArena *arena, json_Element element, Buffer fieldName)
+        MemoryArena *arena, json_Element element, json_Key field)
 {
-    json_Element strElement = json_getElement(element, fieldName);
+    json_Element strElement = json_getElementByKey(element, field);
     check(strElement.type == json_STRING ||
             strElement.type == json_INVALID_ELEMENT);
     Buffer newBuf = {0};
     if(strElement.type == json_STRING) {
-        Buffer oldBuf = strElement.value;
-        u64 commaCount = 0;
-        for(u64 i = 0; i < oldBuf.count; ++i) {
-            char ch = (char)oldBuf.data[i];
-            if(ch == '"') {
-                commaCount += 1;
-            }
+        newBuf = json_decodeString(arena, strElement.value);
+        if(!newBuf.data) {
+            printWarning("invalid string in spotify response, "
+                    "copying it as it is");
+            newBuf = pushBuffer(arena, strElement.value);
+        }
+        u64 quoteCount = 0;
+        u8 *end = newBuf.data + newBuf.count;
+        for(u8 *quote = memchr(newBuf.data, '"', newBuf.count);
+                quote;
+                quote = memchr(quote + 1, '"', end - (quote + 1))) {
+            quoteCount += 1;
         }
-        newBuf = allocateBuffer(arena, oldBuf.count + commaCount);
-        u64 newIndex = 0;
-        for(u64 oldIndex = 0; oldIndex < oldBuf.count; oldIndex += 1) {
-            check(newIndex < newBuf.count);
-            u8 ch = oldBuf.data[oldIndex];
-            newBuf.data[newIndex++] = ch;
-            if(ch == (u8)'"') {
-                newBuf.data[newIndex++] = '"';
+        if(quoteCount) {
+            // the string is the top of the arena, so it can grow in place
+            u8 *tail = pushArray(arena, quoteCount, u8);
+            check(tail == end);
+            u64 from = newBuf.count;
+            u64 to = newBuf.count + quoteCount;
+            while(from != to) {
+                u8 ch = newBuf.data[--from];
+                newBuf.data[--to] = ch;
+                if(ch == '"') {
+                    newBuf.data[--to] = '"';
+                }
             }
+            newBuf.count += quoteCount;
         }
-        check(newIndex == newBuf.count);
     }
     return newBuf;
 }
 
-static json_Element
-parseBufferToJson(MemoryArena *jsonArena, Buffer text)
+// The tokens are read straight from the response text, only the tokens
+// themselves are copied. Returns 0 if the response has no access token, which
+// is the case for error responses.
+static b32
+getAccessTokensFromResponse(
+        NetworkState *nst, AppMemory *memory, Buffer responseText)
 {
-    json_Element *jsonRoot = json_parseJson(jsonArena, text);
-    if(!jsonRoot->type) {
-        errorAndTerminate("couldn't read spotify response");
+    json_Cursor tokenJson = json_makeCursor(responseText);
+    json_Cursor value = {0};
+    if(!json_findField(&tokenJson, jsonKeys.accessToken, &value)) {
+        return 0;
+    }
+    Buffer newAccessToken = json_getString(value);
+    Buffer newRefreshToken = {0};
+    if(json_findField(&tokenJson, jsonKeys.refreshToken, &value)) {
+        newRefreshToken = json_getString(value);
+    }
+    u64 expiresInSeconds = 0;
+    if(json_findField(&tokenJson, jsonKeys.expiresIn, &value)) {
+        expiresInSeconds = json_getU64(value);
     }
-    return *jsonRoot;
-}
-
-static void
-getAccessTokensFromJson(
-        NetworkState *nst, AppMemory *memory, json_Element tokenJson)
-{
-    Buffer newAccessToken =
-        copyString(&memory->persistent, tokenJson, CS("access_token"));
-    Buffer newRefreshToken =
-        copyString(&memory->persistent, tokenJson, CS("refresh_token"));
 
-    if(newAccessToken.count) {
-        nst->accessToken = newAccessToken;
+    // the tokens that aren't renewed are kept, they're moved out of the way
+    // while the arena is cleared
+    TempMemory temp = beginTempMemory(&memory->scratch);
+    if(!newAccessToken.count) {
+        newAccessToken = pushBuffer(&memory->scratch, nst->accessToken);
     }
-    if(newRefreshToken.count) {
-        nst->refreshToken = newRefreshToken;
+    if(!newRefreshToken.count) {
+        newRefreshToken = pushBuffer(&memory->scratch, nst->refreshToken);
     }
+    clearMemoryArena(&memory->tokens);
+    nst->accessToken = pushBuffer(&memory->tokens, newAccessToken);
+    nst->refreshToken = pushBuffer(&memory->tokens, newRefreshToken);
+    endTempMemory(temp);
+    nst->tokenGeneration += 1;
+    nst->tokenRenewalDeadline = NO_TIMER;
+    if(expiresInSeconds) {
+        u64 margin = TOKEN_RENEWAL_MARGIN_SECONDS;
+        u64 renewalSeconds = (expiresInSeconds > 2*margin) ?
+            expiresInSeconds - margin : expiresInSeconds / 2;
+        nst->tokenRenewalDeadline =
+            getNanoseconds() + renewalSeconds*1000000000ull;
+    }
+    return 1;
 }
 
 static Buffer
@@ -373,11 +829,14 @@ cStringConcat3(MemoryArena *arena,
     return newStr;
 }
 
-static void
+// Returns 0 if the file couldn't be written
+static b32
 writePlaylistIntoFile(AppMemory *memory ,Playlist const *playlist)
 {
+    b32 result = 0;
+    TempMemory temp = beginTempMemory(&memory->scratch);
     Buffer playlistPath = 
-        cStringConcat3(&memory->persistent, playlist->name,
+        cStringConcat3(&memory->scratch, playlist->name,
                 CS(".csv"), (Buffer){0});
     FILE *file = fopen((char*)playlistPath.data, "w");
     if(!file) {
@@ -388,128 +847,424 @@ writePlaylistIntoFile(AppMemory *memory ,Playlist const *playlist)
     }
     else {
         fprintf(file,"title,album,artitsts,\"date added\",duration\n");
-        for(u64 i = 0; i < playlist->trackCount; ++i) {
-            Track track = playlist->trackArray[i];
-            fprintf(file, "\"%.*s\",",
-                    (int)track.title.count, track.title.data);
-            fprintf(file, "\"%.*s\",",
-                    (int)track.album.count, track.album.data);
-            fprintf(file, "\"");
-            for(u64 i = 0; i < track.artistCount; ++i) {
-                Buffer artist = track.artistArray[i];
-                fprintf(file, "%.*s", (int)artist.count, artist.data);
-                b32 isLast = (i + 1 == track.artistCount);
-                if(!isLast) {
-                    fprintf(file, ",");
-                }
-            }
-            fprintf(file, "\",");
-            fprintf(file, "\"%.*s\",",
-                    (int)track.dateAdded.count, track.dateAdded.data);
+        for(u64 i = 0; i < playlist->pageCount; ++i) {
+            Buffer rows = playlist->pageRowsArray[i];
+            fwrite(rows.data, 1, rows.count, file);
+        }
+        result = !ferror(file);
+        result = !fclose(file) && result;
+    }
+    endTempMemory(temp);
+    return result;
+}
 
-            int hours = track.durationInMs / 3600000;
-            int minutes = (track.durationInMs / 60000) % 60;
-            int seconds = (track.durationInMs / 1000) % 60;
-            fprintf(file, "\"%02i:%02i:%02i\"\n", hours, minutes, seconds);
+// Called by the streaming parser with each item of a page of tracks, as soon
+// as the item is read. The row goes straight to the end of the handle's CSV
+// arena, the item itself is dropped by the parser afterwards.
+static void
+writeTrackRow(json_Element item, void *userData)
+{
+    MemoryArena *csvArena = (MemoryArena*)userData;
+    json_Element trackJson = json_getElementByKey(item, jsonKeys.track);
+    if(trackJson.type != json_OBJECT) {
+        printWarning("couldn't get track's information, skipping track");
+        return;
+    }
+
+    pushBuffer(csvArena, CS("\""));
+    copyStringAndEscapeCommas(csvArena, trackJson, jsonKeys.name);
+    pushBuffer(csvArena, CS("\",\""));
+    json_Element album = json_getElementByKey(trackJson, jsonKeys.album);
+    copyStringAndEscapeCommas(csvArena, album, jsonKeys.name);
+    pushBuffer(csvArena, CS("\",\""));
+
+    json_Element artistsArray =
+        json_getElementByKey(trackJson, jsonKeys.artists);
+    for(json_Element artist = json_getFirstSubElement(artistsArray);
+            artist.type;
+            artist = json_getNextSibling(artist)) {
+        copyStringAndEscapeCommas(csvArena, artist, jsonKeys.name);
+        if(json_getNextSibling(artist).type) {
+            pushBuffer(csvArena, CS(","));
         }
-        fclose(file);
     }
+    pushBuffer(csvArena, CS("\",\""));
+    copyStringAndEscapeCommas(csvArena, item, jsonKeys.addedAt);
+
+    json_Element durationElement =
+        json_getElementByKey(trackJson, jsonKeys.durationMs);
+    u64 durationInMs = (u64)json_getInteger(durationElement);
+    int hours = durationInMs / 3600000;
+    int minutes = (durationInMs / 60000) % 60;
+    int seconds = (durationInMs / 1000) % 60;
+    char duration[64];
+    int durationCount = snprintf(duration, sizeof(duration),
+            "\",\"%02i:%02i:%02i\"\n", hours, minutes, seconds);
+    Buffer durationBuffer = {.data = (u8*)duration, .count = durationCount};
+    pushBuffer(csvArena, durationBuffer);
 }
 
 static void
-readTracksAndCopyToFileIfDone(AppMemory *memory,
+copyPageRowsAndWriteFileIfDone(AppMemory *memory,
         PlaylistArray const *playlistArray, u64 playlistIndex,
-        json_Element tracksJson, u64 trackOffset)
+        Buffer csvRows, u64 trackOffset)
 {
     Playlist *playlist = &playlistArray->data[playlistIndex];
+    u64 pageIndex = trackOffset / TRACK_PAGE_LIMIT;
+    check(pageIndex < playlist->pageCount);
+    if(!playlist->pageRowsArray) {
+        playlist->arena = borrowMemoryArena(&memory->playlistArenaPool);
+        playlist->pageRowsArray =
+            pushArray(&playlist->arena, playlist->pageCount, Buffer);
+        memset(playlist->pageRowsArray, 0,
+                playlist->pageCount*sizeof(Buffer));
+    }
+    check(!playlist->pageRowsArray[pageIndex].data);
+    playlist->pageRowsArray[pageIndex] =
+        pushBuffer(&playlist->arena, csvRows);
+    playlist->filledPageCount += 1;
+
+    if(playlist->filledPageCount >= playlist->pageCount) {
+        check(playlist->filledPageCount == playlist->pageCount);
+        playlist->isSaved = writePlaylistIntoFile(memory, playlist);
+        // every job of the playlist is done, nothing points into its arena
+        returnMemoryArena(&memory->playlistArenaPool, &playlist->arena);
+        playlist->pageRowsArray = 0;
+    }
+}
 
-    json_Element tracksArrayJson =
-        json_getElement(tracksJson, CS("items"));
-    check(tracksArrayJson.type == json_ARRAY);
-    u64 trackIndex = trackOffset;
-    for(json_Element *item = tracksArrayJson.firstSubElement;
-            item;
-            item = item->nextSibling) {
-
-        Track track = {0};
-        json_Element trackJson = json_getElement(*item, CS("track"));
-        if(trackJson.type != json_OBJECT) {
-            printWarning("couldn't get track's information, skipping track");
-            continue;
+// Manifest
+//
+// MANIFEST_PATH holds a JSON object with the playlists saved by the last run:
+//   {"playlists":[
+//   {"id":"...","snapshot_id":"...","track_count":12,"file":"Name.csv"},
+//   ...
+//   ]}
+// Spotify gives a playlist a new snapshot_id whenever it changes, so a playlist
+// with the same snapshot_id, track count and file as its entry keeps its file.
+// Playlists with the same name write the same file, so they're always
+// downloaded and never go in the manifest. The manifest is rewritten at the
+// end of every run that finishes.
+
+static u64
+hashString(Buffer str)
+{
+    // FNV-1a
+    u64 hash = 14695981039346656037ull;
+    for(u64 i = 0; i < str.count; ++i) {
+        hash ^= str.data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Returns the entry's slot, or the empty slot where it would go
+static ManifestEntry*
+findManifestSlot(Manifest const *manifest, Buffer playlistId)
+{
+    ManifestEntry *slot = 0;
+    if(manifest->slotCount) {
+        u64 mask = manifest->slotCount - 1;
+        u64 index = hashString(playlistId) & mask;
+        slot = &manifest->slotArray[index];
+        while(slot->playlistId.count &&
+                !areEqual(slot->playlistId, playlistId)) {
+            index = (index + 1) & mask;
+            slot = &manifest->slotArray[index];
         }
+    }
+    return slot;
+}
 
-        track.title = copyStringAndEscapeCommas(
-                &memory->persistent, trackJson, CS("name"));
-
-        json_Element album = json_getElement(trackJson, CS("album"));
-        track.album =
-            copyStringAndEscapeCommas(&memory->persistent, album, CS("name"));
-
-        // artists
-        json_Element artistsArray = json_getElement(trackJson, CS("artists"));
-        if(artistsArray.type == json_ARRAY) {
-            u64 artistCount = json_getArrayCount(artistsArray);
-            track.artistArray =
-                pushArray(&memory->persistent, artistCount, Buffer);
-            track.artistCount = artistCount;
-            u64 artistIndex = 0;
-            for(json_Element *artist = artistsArray.firstSubElement;
-                    artist;
-                    artist = artist->nextSibling) {
-                check(artistIndex < artistCount);
-                Buffer artistName = copyStringAndEscapeCommas(
-                        &memory->persistent,*artist,CS("name"));
-                track.artistArray[artistIndex++] = artistName;
-            }
+static b32
+fileExists(char const *path)
+{
+    FILE *file = fopen(path, "r");
+    if(file) {
+        fclose(file);
+    }
+    return file != 0;
+}
+
+// A missing or broken manifest just means every playlist is downloaded
+static void
+loadManifest(Manifest *manifest, MemoryArena *arena)
+{
+    *manifest = (Manifest){0};
+    if(!fileExists(MANIFEST_PATH)) {
+        return;
+    }
+    Buffer text = dumpFileIntoBuffer(arena, MANIFEST_PATH);
+    json_Cursor root = json_makeCursor(text);
+    json_Cursor playlists = {0};
+    if(!json_findField(&root, jsonKeys.playlists, &playlists)) {
+        printWarning("couldn't read \"%s\", downloading every playlist",
+                MANIFEST_PATH);
+        return;
+    }
+    u64 entryCount = 0;
+    json_Cursor array = playlists;
+    json_Cursor item = {0};
+    while(json_iterateArray(&array, &item)) {
+        entryCount += 1;
+    }
+    manifest->slotCount = MIN_MANIFEST_SLOT_COUNT;
+    while(manifest->slotCount < 2*entryCount) {
+        manifest->slotCount *= 2;
+    }
+    manifest->slotArray =
+        pushArray(arena, manifest->slotCount, ManifestEntry);
+    memset(manifest->slotArray, 0,
+            manifest->slotCount*sizeof(ManifestEntry));
+
+    array = playlists;
+    while(json_iterateArray(&array, &item)) {
+        json_Cursor value = {0};
+        ManifestEntry entry = {0};
+        if(json_findField(&item, jsonKeys.id, &value)) {
+            entry.playlistId = json_getString(value);
+        }
+        if(json_findField(&item, jsonKeys.snapshotId, &value)) {
+            entry.snapshotId = json_getString(value);
         }
+        if(json_findField(&item, jsonKeys.trackCount, &value)) {
+            entry.trackCount = json_getU64(value);
+        }
+        if(json_findField(&item, jsonKeys.file, &value)) {
+            entry.fileName = json_getString(value);
+        }
+        if(entry.playlistId.count && entry.snapshotId.count &&
+                entry.fileName.count) {
+            *findManifestSlot(manifest, entry.playlistId) = entry;
+        }
+    }
+}
 
-        track.dateAdded = copyStringAndEscapeCommas(
-                &memory->persistent, *item, CS("added_at"));
+static b32
+isPlaylistUnchanged(Manifest const *manifest, MemoryArena *scratch,
+        Playlist const *playlist)
+{
+    ManifestEntry const *entry = findManifestSlot(manifest, playlist->id);
+    b32 result = entry && entry->playlistId.count &&
+        playlist->snapshotId.count &&
+        areEqual(entry->snapshotId, playlist->snapshotId) &&
+        entry->trackCount == playlist->trackCount;
+    if(result) {
+        TempMemory temp = beginTempMemory(scratch);
+        Buffer path = cStringConcat3(scratch, playlist->name,
+                CS(".csv"), (Buffer){0});
+        // the path ends with the null char
+        Buffer fileName = {.data = path.data, .count = path.count - 1};
+        result = areEqual(entry->fileName, fileName) &&
+            fileExists((char*)path.data);
+        endTempMemory(temp);
+    }
+    return result;
+}
 
-        json_Element durationElement =
-            json_getElement(trackJson, CS("duration_ms"));
-        track.durationInMs = (u64)json_getNumber(durationElement);
+// Written next to the old one first, so a run that dies halfway leaves the
+// old one as it was
+static void
+writeManifest(PlaylistArray const *playlistArray)
+{
+    char const *tempPath = MANIFEST_PATH".tmp";
+    FILE *file = fopen(tempPath, "w");
+    if(!file) {
+        printWarning("couldn't write \"%s\"", tempPath);
+        return;
+    }
+    fprintf(file, "{\"playlists\":[\n");
+    b32 isFirst = 1;
+    for(u64 i = 0; i < playlistArray->count; ++i) {
+        Playlist const *playlist = &playlistArray->data[i];
+        if(!playlist->isSaved || playlist->sharesFile ||
+                !playlist->snapshotId.count) {
+            continue;
+        }
+        fprintf(file, "%s{\"id\":\"%.*s\",\"snapshot_id\":\"%.*s\","
+                "\"track_count\":%llu,\"file\":\"%.*s.csv\"}",
+                isFirst ? "" : ",\n",
+                (int)playlist->id.count, playlist->id.data,
+                (int)playlist->snapshotId.count, playlist->snapshotId.data,
+                (unsigned long long)playlist->trackCount,
+                (int)playlist->name.count, playlist->name.data);
+        isFirst = 0;
+    }
+    fprintf(file, "\n]}\n");
+    b32 isWritten = !ferror(file);
+    isWritten = !fclose(file) && isWritten;
+    if(!isWritten || rename(tempPath, MANIFEST_PATH)) {
+        printWarning("couldn't write \"%s\"", MANIFEST_PATH);
+        remove(tempPath);
+    }
+}
+
+// Request shaping
+//
+// Pages are asked for with the largest limit spotify allows. Spotify also
+// sends only the fields a request asks for, so every request asks for exactly
+// the ones its job's projection keeps. Jobs don't keep URIs, they're built
+// with their fields when the request is sent.
 
-        playlist->trackArray[trackIndex++] = track;
-        playlist->filledTrackCount += 1;
+static Buffer
+makePlaylistListUri(MemoryArena *arena, u64 offset)
+{
+    return bufferConcat5(arena,
+            CS(PLAYLIST_LIST_URI"?offset="), u64ToString(arena, offset),
+            CS("&limit="), u64ToString(arena, PLAYLIST_PAGE_LIMIT),
+            (Buffer){0});
+}
+
+static Buffer
+makeTrackListUri(MemoryArena *arena, Buffer playlistId, u64 offset)
+{
+    Buffer playlistUri = bufferConcat(arena, CS(PLAYLIST_URI), playlistId);
+    return bufferConcat5(arena,
+            playlistUri, CS("/tracks?offset="), u64ToString(arena, offset),
+            CS("&limit="), u64ToString(arena, TRACK_PAGE_LIMIT));
+}
+
+// Returns the job's URI with its fields, as a C string. It's only needed
+// while the request is configured, so everything goes to the scratch arena.
+static Buffer
+makeRequestUri(MemoryArena *scratch, NetworkState const *nst, Job const *job)
+{
+    Buffer uri = {0};
+    switch(job->type) {
+    case Job_zero:
+    case Job_typeCount:
+    {
+        check(0 && "the job has no request");
+    } break;
+    case Job_playlistListHeader:
+    case Job_playlistList:
+    {
+        uri = makePlaylistListUri(scratch, job->offset);
+    } break;
+    case Job_trackList:
+    {
+        uri = makeTrackListUri(scratch, job->playlistId, job->offset);
+    } break;
     }
+    Buffer fields = nst->jobTypeToFieldsMap[job->type];
+    return fields.count ?
+        cStringConcat3(scratch, uri, CS("&fields="), fields) :
+        pushBufferAsCString(scratch, uri);
+}
 
-    if(playlist->filledTrackCount >= playlist->trackCount) {
-        check(playlist->filledTrackCount == playlist->trackCount);
-        writePlaylistIntoFile(memory, playlist);
+// Returns the playlist read before with the same name, or adds this one to
+// the table if there's none
+static Playlist*
+findPlaylistWithSameName(PlaylistArray const *playlistArray,
+        u64 playlistIndex)
+{
+    Buffer name = playlistArray->data[playlistIndex].name;
+    u64 mask = playlistArray->nameSlotCount - 1;
+    u64 i = hashString(name) & mask;
+    u64 *slots = playlistArray->nameSlotArray;
+    while(slots[i]) {
+        Playlist *other = &playlistArray->data[slots[i] - 1];
+        if(areEqual(other->name, name)) {
+            return other;
+        }
+        i = (i + 1) & mask;
     }
+    slots[i] = playlistIndex + 1;
+    return 0;
 }
 
 static void
-readPlaylistIdsAndQueueJobs(
-        JobQueue *jq, AppMemory *memory,
+queuePlaylistPages(JobQueue *jq, AppMemory *memory,
+        PlaylistArray const *playlistArray, u64 playlistIndex)
+{
+    Playlist *playlist = &playlistArray->data[playlistIndex];
+    fprintf(stderr, "reading playlist \"%.*s\"...\n",
+            (int)playlist->name.count, playlist->name.data);
+    playlist->pageCount =
+        (playlist->trackCount + TRACK_PAGE_LIMIT - 1) / TRACK_PAGE_LIMIT;
+    for(u64 pageIndex = 0; pageIndex < playlist->pageCount; ++pageIndex) {
+        Job newJob = {
+            .type = Job_trackList,
+            .playlistId = playlist->id,
+            .playlistIndex = playlistIndex,
+            .offset = TRACK_PAGE_LIMIT * pageIndex,
+        };
+        enqueueJob(jq, newJob);
+    }
+    // there's no page to wait for
+    if(!playlist->pageCount) {
+        playlist->isSaved = writePlaylistIntoFile(memory, playlist);
+    }
+}
+
+// Every page of tracks of the playlists is queued right away, the list
+// already says how many tracks each playlist has. Playlists that didn't change
+// since the manifest was written aren't downloaded at all.
+static void
+readPlaylistsAndQueueJobs(
+        JobQueue *jq, AppMemory *memory, Manifest const *manifest,
         PlaylistArray const *playlistArray, u64 playlistOffset,
         json_Element playlistArrayJson) {
 
     u64 playlistIndex = playlistOffset;
-    for(json_Element *item = playlistArrayJson.firstSubElement;
-            item;
-            item = item->nextSibling) {
-        Buffer playlistId =
-            copyString(&memory->persistent, *item, CS("id"));
-        Job playlistJob = {
-            .type = Job_playlistHeader,
-            .uri = bufferConcat(
-                    &memory->persistent, CS(PLAYLIST_URI), playlistId),
-            .playlistIndex = playlistIndex,
+    // playlists added since the first page was read are left out
+    for(json_Element item = json_getFirstSubElement(playlistArrayJson);
+            item.type && playlistIndex < playlistArray->count;
+            item = json_getNextSibling(item)) {
+        Playlist *playlist = &playlistArray->data[playlistIndex];
+        json_Element tracksJson =
+            json_getElementByKey(item, jsonKeys.tracks);
+        json_Element jsonTotal =
+            json_getElementByKey(tracksJson, jsonKeys.total);
+        *playlist = (Playlist){
+            .name = copyString(&memory->persistent, item, jsonKeys.name),
+            .id = copyString(&memory->persistent, item, jsonKeys.id),
+            .snapshotId =
+                copyString(&memory->persistent, item, jsonKeys.snapshotId),
+            .trackCount = json_getInteger(jsonTotal),
         };
-        enqueueJob(jq, playlistJob);
+        if(!playlist->id.count || !jsonTotal.type) {
+            printWarning("couldn't retrieve playlist \"%.*s\" from spotify, "
+                    "skipping playlist...",
+                    (int)playlist->name.count, playlist->name.data);
+            playlistIndex += 1;
+            continue;
+        }
+        Playlist *sameName =
+            findPlaylistWithSameName(playlistArray, playlistIndex);
+        if(sameName) {
+            playlist->sharesFile = 1;
+            sameName->sharesFile = 1;
+            // the file it kept may be this playlist's
+            if(sameName->isKept) {
+                sameName->isKept = 0;
+                sameName->isSaved = 0;
+                queuePlaylistPages(jq, memory, playlistArray,
+                        sameName - playlistArray->data);
+            }
+        }
+        if(!playlist->sharesFile &&
+                isPlaylistUnchanged(manifest, &memory->scratch, playlist)) {
+            fprintf(stderr, "playlist \"%.*s\" hasn't changed, "
+                    "keeping its file\n",
+                    (int)playlist->name.count, playlist->name.data);
+            playlist->isKept = 1;
+            playlist->isSaved = 1;
+        }
+        else {
+            queuePlaylistPages(jq, memory, playlistArray, playlistIndex);
+        }
         playlistIndex += 1;
-        check(playlistIndex <= playlistArray->count);
     }
 }
 
 static void
-processJob(JobQueue *jq, AppMemory *memory,
+processJob(JobQueue *jq, AppMemory *memory, Manifest const *manifest,
         PlaylistArray *playlistArray, Job job)
 {
     switch(job.type) {
     case Job_zero:
+    case Job_typeCount:
     {
     } break;
     case Job_playlistListHeader:
@@ -520,24 +1275,22 @@ processJob(JobQueue *jq, AppMemory *memory,
         }
 
         json_Element jsonTotal =
-            json_getElement(playlistListJson, CS("total"));
+            json_getElementByKey(playlistListJson, jsonKeys.total);
         json_Element jsonLimit = 
-            json_getElement(playlistListJson, CS("limit"));
+            json_getElementByKey(playlistListJson, jsonKeys.limit);
 
-        u64 totalPlaylistCount = json_getNumber(jsonTotal);
-        u64 playlistsPerPage = json_getNumber(jsonLimit);
+        u64 totalPlaylistCount = json_getInteger(jsonTotal);
+        u64 playlistsPerPage = json_getInteger(jsonLimit);
         u64 pageCount = playlistsPerPage ?
             (totalPlaylistCount + playlistsPerPage - 1) / playlistsPerPage : 0;
 
+        // the first page was asked with PLAYLIST_PAGE_LIMIT, but spotify
+        // may have sent less
+        check(playlistsPerPage <= PLAYLIST_PAGE_LIMIT);
         for(u64 pageIndex = 1; pageIndex < pageCount; ++pageIndex) {
             u64 offset = playlistsPerPage * pageIndex;
-            Buffer offsetString = u64ToString(&memory->persistent, offset);
-            Buffer pageUri = bufferConcat5(&memory->persistent,
-                    job.uri, CS("/shows?offset="), offsetString,
-                    CS("&limit="), jsonLimit.value);
             Job newJob = {
                 .type = Job_playlistList,
-                .uri = pageUri,
                 .offset = offset,
             };
             enqueueJob(jq, newJob);
@@ -546,17 +1299,25 @@ processJob(JobQueue *jq, AppMemory *memory,
         playlistArray->data =
             pushArray(&memory->persistent, totalPlaylistCount, Playlist);
         playlistArray->count = totalPlaylistCount;
+        playlistArray->nameSlotCount = 1;
+        while(playlistArray->nameSlotCount < 2*totalPlaylistCount) {
+            playlistArray->nameSlotCount *= 2;
+        }
+        playlistArray->nameSlotArray = pushArray(&memory->persistent,
+                playlistArray->nameSlotCount, u64);
+        memset(playlistArray->nameSlotArray, 0,
+                playlistArray->nameSlotCount*sizeof(u64));
 
         check(job.offset == 0 &&
                 "Job_playlistListHeader should be the first job that "
                 "reads playlists ids from the user");
 
         json_Element playlistArrayJson =
-            json_getElement(playlistListJson, CS("items"));
+            json_getElementByKey(playlistListJson, jsonKeys.items);
         if(playlistArrayJson.type != json_ARRAY) {
             errorAndTerminate("couldn't retrieve playlists from spotify");
         }
-        readPlaylistIdsAndQueueJobs(jq, memory,
+        readPlaylistsAndQueueJobs(jq, memory, manifest,
                 playlistArray, job.offset, playlistArrayJson);
     } break;
     case Job_playlistList:
@@ -566,114 +1327,113 @@ processJob(JobQueue *jq, AppMemory *memory,
             errorAndTerminate("couldn't retrieve some playlists from spotify");
         }
         json_Element playlistArrayJson =
-            json_getElement(playlistListJson, CS("items"));
+            json_getElementByKey(playlistListJson, jsonKeys.items);
         if(playlistArrayJson.type != json_ARRAY) {
             errorAndTerminate("couldn't retrieve some playlists from spotify");
         }
 
-        readPlaylistIdsAndQueueJobs(jq, memory,
+        readPlaylistsAndQueueJobs(jq, memory, manifest,
                 playlistArray, job.offset, playlistArrayJson);
     } break;
-    case Job_playlistHeader:
-    {
-        json_Element playlistJson = job.json;
-        if(!playlistJson.type) {
-            printWarning("couldn't retrieve playlist from spotify "
-                    "skipping playlist...");
-        }
-        else {
-            Buffer playlistName =
-                copyString(&memory->persistent, playlistJson, CS("name"));
-            json_Element tracksJson =
-                json_getElement(playlistJson, CS("tracks"));
-
-            if(!tracksJson.type) {
-                printWarning("couldn't read some tracks from playlist "
-                        "\"%.*s\"\n",
-                        (int)playlistName.count, playlistName.data);
-            }
-
-            fprintf(stderr, "reading playlist \"%.*s\"...\n",
-                    (int)playlistName.count, playlistName.data); 
-
-            json_Element jsonTotal =
-                json_getElement(tracksJson, CS("total"));
-            json_Element jsonLimit = 
-                json_getElement(tracksJson, CS("limit"));
-
-            u64 totalTracksCount = json_getNumber(jsonTotal);
-            u64 tracksPerPage = json_getNumber(jsonLimit);
-            u64 pageCount = tracksPerPage ?
-                (totalTracksCount + tracksPerPage - 1) / tracksPerPage : 0;
-            for(u64 pageIndex = 1; pageIndex < pageCount; ++pageIndex) {
-                u64 offset = tracksPerPage * pageIndex;
-                Buffer offsetString = u64ToString(&memory->persistent, offset);
-                Buffer pageUri = bufferConcat5(&memory->persistent,
-                        job.uri, CS("/tracks?offset="), offsetString,
-                        CS("&limit="), jsonLimit.value);
-                Job newJob = {
-                    .type = Job_trackList,
-                    .uri = pageUri,
-                    .playlistIndex = job.playlistIndex,
-                    .offset = offset,
-                };
-                enqueueJob(jq, newJob);
-            }
-
-            Track *trackArray =
-                pushArray(&memory->persistent, totalTracksCount, Track);
-
-            playlistArray->data[job.playlistIndex] = (Playlist) {
-                .name = playlistName,
-                .trackArray = trackArray,
-                .trackCount = totalTracksCount,
-            };
-
-            check(job.offset == 0 &&
-                    "Job_playlistHeader should be the first job that "
-                    "reads tracks from a playlist");
-            readTracksAndCopyToFileIfDone(
-                    memory, playlistArray, job.playlistIndex,
-                    tracksJson, job.offset);
-        }
-    } break;
     case Job_trackList:
     {
-        json_Element tracksJson = job.json;
-        if(!tracksJson.type) {
+        if(!job.json.type) {
             printWarning("couldn't access tracks page, skipping some tracks");
         }
-        readTracksAndCopyToFileIfDone(memory, playlistArray, job.playlistIndex,
-                tracksJson, job.offset);
-
+        copyPageRowsAndWriteFileIfDone(memory, playlistArray,
+                job.playlistIndex, job.csvRows, job.offset);
     } break;
     }
 }
 
 static void
-renewAccessToken(NetworkState *nst, AppMemory *memory)
+addProjectionPaths(MemoryArena *arena, json_Projection *projection,
+        Buffer const *pathArray, u64 pathCount)
 {
+    for(u64 i = 0; i < pathCount; ++i) {
+        json_addProjectionPath(arena, projection, pathArray[i]);
+    }
+}
+
+static void
+initJobProjections(NetworkState *nst, MemoryArena *arena)
+{
+    // NOTE: these must cover every field processJob reads, anything else is
+    // left out of the responses by spotify and skipped by the parser.
+    Buffer const playlistListPaths[] = {
+        CS("total"),
+        CS("limit"),
+        CS("items[].id"),
+        CS("items[].name"),
+        CS("items[].snapshot_id"),
+        CS("items[].tracks.total"),
+    };
+    // the items of the pages of tracks are turned into CSV rows by
+    // writeTrackRow while they're parsed, these are the fields it reads
+    Buffer const trackListPaths[] = {
+        CS("items[].added_at"),
+        CS("items[].track.name"),
+        CS("items[].track.album.name"),
+        CS("items[].track.artists[].name"),
+        CS("items[].track.duration_ms"),
+    };
+    json_Projection *map = nst->jobTypeToProjectionMap;
+    addProjectionPaths(arena, &map[Job_playlistListHeader],
+            playlistListPaths, ARRAY_COUNT(playlistListPaths));
+    addProjectionPaths(arena, &map[Job_playlistList],
+            playlistListPaths, ARRAY_COUNT(playlistListPaths));
+    addProjectionPaths(arena, &map[Job_trackList],
+            trackListPaths, ARRAY_COUNT(trackListPaths));
+    json_setProjectionCallback(arena, &map[Job_trackList],
+            CS("items[]"), writeTrackRow);
+    for(u64 type = 0; type < Job_typeCount; ++type) {
+        nst->jobTypeToFieldsMap[type] =
+            json_writeProjectionFields(arena, &map[type]);
+    }
+}
+
+// The token is renewed by handle 0 in the multi handle, next to the other
+// transfers. Does nothing if a renewal is already on its way.
+static void
+beginAccessTokenRenewal(NetworkState *nst, AppMemory *memory)
+{
+    if(nst->isRenewingToken) {
+        return;
+    }
     CURL *handle = nst->easyHandleArray[0];
     MemoryArena *handleArena = &nst->handleToArenaMap[0];
-    Buffer post = cStringConcat3(&memory->persistent,
+    clearMemoryArena(handleArena);
+    TempMemory temp = beginTempMemory(&memory->scratch);
+    Buffer post = cStringConcat3(&memory->scratch,
         CS("grant_type=refresh_token&refresh_token="),
         nst->refreshToken, (Buffer){0});
-    httpPostToken(handle, handleArena, post);
-    long code_post = 0;
+    configureTokenRequest(handle, handleArena, post);
+    endTempMemory(temp);
+    CURLMcode code = curl_multi_add_handle(nst->multiHandle, handle);
+    check(!code);
+    nst->busyHandleFlagArray[0] = 1;
+    nst->busyHandleCount += 1;
+    nst->runningHandleCount += 1;
+    nst->isRenewingToken = 1;
+}
 
-    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code_post);
-    if(code_post != OK_RESPONSE) {
+static void
+finishAccessTokenRenewal(NetworkState *nst, AppMemory *memory)
+{
+    CURL *handle = nst->easyHandleArray[0];
+    MemoryArena *handleArena = &nst->handleToArenaMap[0];
+    long responseCode = 0;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &responseCode);
+    if(responseCode != OK_RESPONSE) {
         errorAndTerminate("problem while connecting with spotify");
     }
     Buffer text =
         {.data = handleArena->data, .count = handleArena->count};
-    json_Element tokenJson = parseBufferToJson(&memory->scratch, text);
-    json_Element error = json_getElement(tokenJson, CS("error"));
-    if(error.type) {
+    if(!getAccessTokensFromResponse(nst, memory, text)) {
         errorAndTerminate("problem while connecting with spotify");
     }
-    getAccessTokensFromJson(nst, memory, tokenJson);
-    clearMemoryArena(&memory->scratch);
+    nst->isRenewingToken = 0;
+    nst->isTokenRejected = 0;
 }
 
 static void
@@ -682,26 +1442,69 @@ configureEasyHandleAndAddToMulti(
 {
     CURL *easyHandle = nst->easyHandleArray[handleIndex];
     MemoryArena *handleArena = &nst->handleToArenaMap[handleIndex]; 
-    Buffer cStringUri = pushBufferAsCString(&memory->persistent, job.uri);
+    MemoryArena *tapeArena = &nst->handleToTapeArenaMap[handleIndex];
+    MemoryArena *csvArena = &nst->handleToCsvArenaMap[handleIndex];
+    json_StreamParser *parser = &nst->handleToParserMap[handleIndex];
+    ArenaPool *pool = &nst->responseArenaPool;
+    *handleArena = borrowMemoryArena(pool);
+    *tapeArena = borrowMemoryArena(pool);
+    *csvArena = borrowMemoryArena(pool);
+    Response *response = &nst->handleToResponseMap[handleIndex];
+    *response = (Response){
+        .parser = parser,
+        .budgetByteCount = DEFAULT_RESPONSE_BYTE_COUNT,
+    };
+    // the response is parsed while it arrives, straight into the handle's
+    // arenas
+    json_beginStream(parser, tapeArena, handleArena,
+            &nst->jobTypeToProjectionMap[job.type], csvArena);
+    // libcurl keeps its own copies of these strings
+    TempMemory temp = beginTempMemory(&memory->scratch);
+    Buffer cStringUri = makeRequestUri(&memory->scratch, nst, &job);
     Buffer accessTokenCString =
-        pushBufferAsCString(&memory->persistent, nst->accessToken);
+        pushBufferAsCString(&memory->scratch, nst->accessToken);
     curl_easy_setopt(easyHandle, CURLOPT_VERBOSE, 0);
     curl_easy_setopt(easyHandle, CURLOPT_WRITEFUNCTION,
-            writeDataLibcurlCallback);
-    curl_easy_setopt(easyHandle, CURLOPT_WRITEDATA, handleArena);
+            parseDataLibcurlCallback);
+    curl_easy_setopt(easyHandle, CURLOPT_WRITEDATA, response);
+    curl_easy_setopt(easyHandle, CURLOPT_HEADERFUNCTION,
+            readHeaderLibcurlCallback);
+    curl_easy_setopt(easyHandle, CURLOPT_HEADERDATA, response);
+    // "" asks for every encoding libcurl was built with, gzip and deflate,
+    // and brotli or zstd when it has them
+    curl_easy_setopt(easyHandle, CURLOPT_ACCEPT_ENCODING, "");
     curl_easy_setopt(easyHandle, CURLOPT_HTTPGET, 1);
     curl_easy_setopt(easyHandle, CURLOPT_HTTPAUTH, CURLAUTH_BEARER);
     curl_easy_setopt(easyHandle, CURLOPT_XOAUTH2_BEARER,
             accessTokenCString.data);
     curl_easy_setopt(easyHandle, CURLOPT_URL, cStringUri.data);
+    endTempMemory(temp);
     CURLMcode code = curl_multi_add_handle(nst->multiHandle, easyHandle);
     check(!code);
     nst->busyHandleFlagArray[handleIndex] = 1;
     nst->busyHandleCount += 1;
-    check(nst->busyHandleCount < nst->easyHandleCount);
+    // libcurl counts it as running from now on
+    nst->runningHandleCount += 1;
+    check(nst->busyHandleCount <= nst->easyHandleCount);
+    job.tokenGeneration = nst->tokenGeneration;
     nst->handleToJobMap[handleIndex] = job;
 }
 
+static CURL*
+createEasyHandle(NetworkState *nst)
+{
+    CURL *easy = curl_easy_init();
+    check(easy);
+    curl_easy_setopt(easy, CURLOPT_SHARE, nst->share);
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    // waiting for a connection that can multiplex beats opening a new one
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+#ifdef CA_CERTIFICATE_PATH
+    curl_easy_setopt(easy, CURLOPT_CAINFO, CA_CERTIFICATE_PATH);
+#endif
+    return easy;
+}
+
 static u64
 findFreeHandle(NetworkState *nst)
 {
@@ -713,6 +1516,12 @@ findFreeHandle(NetworkState *nst)
             break;
         }
     }
+    // the pool only grows when every handle it has is busy
+    if(!freeIndex && count < MAX_CONNECTION_COUNT + 1) {
+        nst->easyHandleArray[count] = createEasyHandle(nst);
+        nst->easyHandleCount = count + 1;
+        freeIndex = count;
+    }
     return freeIndex;
 }
 
@@ -727,40 +1536,330 @@ removeEasyHandleFromMulti(NetworkState *nst, u64 handleIndex)
     nst->busyHandleCount -= 1;
 }
 
+static void
+initRateLimiter(RateLimiter *limiter)
+{
+    u64 now = getNanoseconds();
+    *limiter = (RateLimiter){
+        .rate = MAX_REQUEST_RATE,
+        .tokenCount = REQUEST_BURST_COUNT,
+        .lastRefillTime = now,
+        .startTime = now,
+    };
+}
+
+static void
+refillRateLimiter(RateLimiter *limiter, u64 now)
+{
+    if(now > limiter->lastRefillTime) {
+        f64 seconds = (now - limiter->lastRefillTime) / 1e9;
+        limiter->tokenCount += seconds * limiter->rate;
+        if(limiter->tokenCount > REQUEST_BURST_COUNT) {
+            limiter->tokenCount = REQUEST_BURST_COUNT;
+        }
+        limiter->lastRefillTime = now;
+    }
+}
+
+static b32
+canStartRequest(RateLimiter *limiter)
+{
+    u64 now = getNanoseconds();
+    refillRateLimiter(limiter, now);
+    return now >= limiter->pausedUntil && limiter->tokenCount >= 1.0;
+}
+
+// When the next request may start
+static u64
+getRateLimiterReadyTime(RateLimiter *limiter)
+{
+    u64 now = getNanoseconds();
+    refillRateLimiter(limiter, now);
+    f64 missingTokenCount = 1.0 - limiter->tokenCount;
+    u64 readyTime = (missingTokenCount > 0.0) ?
+        now + (u64)(missingTokenCount / limiter->rate * 1e9) : now;
+    return (readyTime > limiter->pausedUntil) ?
+        readyTime : limiter->pausedUntil;
+}
+
+// Returns whether the requests were running until now, the ones that were
+// already in flight are refused together and only count once
+static b32
+throttleRateLimiter(RateLimiter *limiter, u64 retryAfterSeconds)
+{
+    u64 now = getNanoseconds();
+    retryAfterSeconds = retryAfterSeconds ?
+        retryAfterSeconds : DEFAULT_RETRY_AFTER_SECONDS;
+    b32 isNewThrottling = now >= limiter->pausedUntil;
+    if(isNewThrottling) {
+        limiter->rate /= 2.0;
+        if(limiter->rate < MIN_REQUEST_RATE) {
+            limiter->rate = MIN_REQUEST_RATE;
+        }
+    }
+    u64 pausedUntil = now + retryAfterSeconds*1000000000ull;
+    if(pausedUntil > limiter->pausedUntil) {
+        limiter->pausedUntil = pausedUntil;
+    }
+    // no burst once the pause is over
+    limiter->tokenCount = 0.0;
+    limiter->lastRefillTime = limiter->pausedUntil;
+    limiter->throttledRequestCount += 1;
+    return isNewThrottling;
+}
+
+static void
+recoverRateLimiter(RateLimiter *limiter)
+{
+    limiter->rate += REQUEST_RATE_RECOVERY;
+    if(limiter->rate > MAX_REQUEST_RATE) {
+        limiter->rate = MAX_REQUEST_RATE;
+    }
+    limiter->completedRequestCount += 1;
+}
+
+static void
+printRateLimiterSummary(RateLimiter const *limiter)
+{
+    f64 seconds = (getNanoseconds() - limiter->startTime) / 1e9;
+    fprintf(stderr, "%llu requests in %.1f s (%.1f per second), "
+            "%llu throttled\n",
+            (unsigned long long)limiter->completedRequestCount, seconds,
+            seconds > 0.0 ? limiter->completedRequestCount / seconds : 0.0,
+            (unsigned long long)limiter->throttledRequestCount);
+}
+
+static void
+initConcurrencyController(ConcurrencyController *cc)
+{
+    *cc = (ConcurrencyController){
+        .limit = MIN_CONNECTION_COUNT,
+        .isSlowStart = 1,
+        .roundStartTime = getNanoseconds(),
+        .minLatency = (u64)-1,
+    };
+}
+
+static void
+decreaseConcurrency(ConcurrencyController *cc)
+{
+    // the other requests of the round saw the same congestion, it only
+    // counts once
+    if(!cc->isRoundCongested) {
+        cc->limit *= CONCURRENCY_DECREASE;
+        if(cc->limit < MIN_CONNECTION_COUNT) {
+            cc->limit = MIN_CONNECTION_COUNT;
+        }
+        cc->isSlowStart = 0;
+        cc->isRoundCongested = 1;
+        cc->decreaseCount += 1;
+    }
+}
+
+static void
+endConcurrencyRoundIfOver(ConcurrencyController *cc)
+{
+    if(cc->roundRequestCount >= (u64)cc->limit) {
+        u64 now = getNanoseconds();
+        if(cc->roundSuccessCount && now > cc->roundStartTime) {
+            f64 throughput =
+                cc->roundSuccessCount / ((now - cc->roundStartTime) / 1e9);
+            f64 meanLatency =
+                (f64)cc->roundLatencySum / cc->roundSuccessCount;
+            // more requests in flight only made each of them slower
+            if(meanLatency > LATENCY_TOLERANCE * cc->minLatency &&
+                    throughput <= cc->lastThroughput) {
+                decreaseConcurrency(cc);
+            }
+            cc->lastThroughput = throughput;
+        }
+        cc->roundStartTime = now;
+        cc->roundRequestCount = 0;
+        cc->roundSuccessCount = 0;
+        cc->roundLatencySum = 0;
+        cc->isRoundCongested = 0;
+    }
+}
+
+// latency is in microseconds
+static void
+finishConcurrentRequest(ConcurrencyController *cc, u64 latency)
+{
+    if(latency < cc->minLatency) {
+        cc->minLatency = latency;
+    }
+    cc->roundRequestCount += 1;
+    cc->roundSuccessCount += 1;
+    cc->roundLatencySum += latency;
+    cc->limit += cc->isSlowStart ? 1.0 : CONCURRENCY_INCREASE / cc->limit;
+    if(cc->limit > MAX_CONNECTION_COUNT) {
+        cc->limit = MAX_CONNECTION_COUNT;
+    }
+    endConcurrencyRoundIfOver(cc);
+}
+
+static void
+throttleConcurrentRequest(ConcurrencyController *cc, b32 isNewThrottling)
+{
+    if(isNewThrottling) {
+        decreaseConcurrency(cc);
+    }
+    cc->roundRequestCount += 1;
+    endConcurrencyRoundIfOver(cc);
+}
+
+static void
+printConcurrencySummary(NetworkState const *nst)
+{
+    ConcurrencyController const *cc = &nst->concurrency;
+    fprintf(stderr, "%llu connections opened, %.1f allowed at the end, "
+            "%llu decreases\n",
+            (unsigned long long)(nst->easyHandleCount - 1), cc->limit,
+            (unsigned long long)cc->decreaseCount);
+}
+
+static void
+printTransferSummary(NetworkState const *nst)
+{
+    fprintf(stderr, "%.1f MB received, %.1f MB decoded, %llu of %llu responses "
+            "compressed (%.1fx)\n",
+            nst->wireByteCount / (f64)MEGABYTE,
+            nst->decodedByteCount / (f64)MEGABYTE,
+            (unsigned long long)nst->encodedResponseCount,
+            (unsigned long long)nst->responseCount,
+            nst->encodedWireByteCount ?
+                nst->encodedDecodedByteCount / (f64)nst->encodedWireByteCount :
+                0.0);
+    fprintf(stderr, "%llu new connections, time to first byte %.1f ms for the "
+            "first request, %.1f ms on average\n",
+            (unsigned long long)nst->newConnectionCount,
+            nst->firstByteMicroseconds / 1e3,
+            nst->firstByteRequestCount ?
+                nst->firstByteTotalMicroseconds / 1e3 /
+                    nst->firstByteRequestCount : 0.0);
+}
+
+static void
+printMemorySummary(void)
+{
+    fprintf(stderr, "peak RSS %.1f MB, %llu page faults\n",
+            getPeakResidentByteCount() / (f64)MEGABYTE,
+            (unsigned long long)getPageFaultCount());
+}
+
 static void
 addRequest(NetworkState *nst, AppMemory *memory, JobQueue *jq, Job job)
 {
-    if(!job.uri.count) {
+    if(!job.type) {
         return;
     }
     u64 handleIndex = findFreeHandle(nst);
     if(handleIndex) {
+        nst->rateLimiter.tokenCount -= 1.0;
         configureEasyHandleAndAddToMulti(nst, memory, handleIndex, job);
     }
     else {
-        enqueueJob(jq, job);
+        requeueJob(jq, job);
     }
 }
 
-static void
-updateRequests(NetworkState *nst) 
+// Time to wait until wakeTime, in getNanoseconds time, up to IDLE_WAIT_MS
+static int
+getWaitMs(u64 wakeTime)
 {
-    int handleCount = 0;
-    CURLMcode code = curl_multi_perform(nst->multiHandle, &handleCount);
-    check(!code);
+    int waitMs = IDLE_WAIT_MS;
+    if(wakeTime != NO_TIMER) {
+        u64 now = getNanoseconds();
+        u64 waitNs = (wakeTime > now) ? wakeTime - now : 0;
+        u64 ms = (waitNs + 999999) / 1000000;
+        waitMs = (ms < IDLE_WAIT_MS) ? (int)ms : IDLE_WAIT_MS;
+    }
+    return waitMs;
 }
 
+#if USE_EPOLL
+// Called by libcurl whenever the events it wants from a socket change
+static int
+watchSocketLibcurlCallback(CURL *easyHandle, curl_socket_t socket, int what,
+        void *userp, void *socketp)
+{
+    (void)easyHandle;
+    NetworkState *nst = (NetworkState*)userp;
+    if(what == CURL_POLL_REMOVE) {
+        // the socket may be closed already, which removes it by itself
+        epoll_ctl(nst->epollFd, EPOLL_CTL_DEL, socket, 0);
+        curl_multi_assign(nst->multiHandle, socket, 0);
+    }
+    else {
+        struct epoll_event event = {
+            .events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) |
+                ((what & CURL_POLL_OUT) ? EPOLLOUT : 0),
+            .data.fd = socket,
+        };
+        int operation = socketp ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        int error = epoll_ctl(nst->epollFd, operation, socket, &event);
+        if(error && operation == EPOLL_CTL_ADD) {
+            // a new socket that got the number of one closed before its
+            // removal
+            error = epoll_ctl(nst->epollFd, EPOLL_CTL_MOD, socket, &event);
+        }
+        check(!error);
+        curl_multi_assign(nst->multiHandle, socket, nst);
+    }
+    return 0;
+}
+
+static int
+setTimerLibcurlCallback(CURLM *multiHandle, long timeoutMs, void *userp)
+{
+    (void)multiHandle;
+    NetworkState *nst = (NetworkState*)userp;
+    nst->timerDeadline = (timeoutMs < 0) ?
+        NO_TIMER : getNanoseconds() + (u64)timeoutMs*1000000ull;
+    return 0;
+}
+
+// Sleeps until a socket is ready, libcurl's timer expires or wakeTime comes,
+// and lets libcurl work only on the sockets and timer that are ready
 static void
-waitForRequests(NetworkState *nst)
+waitForRequests(NetworkState *nst, u64 wakeTime)
 {
-    int handleCount = 0;
-    CURLMcode code = curl_multi_perform(nst->multiHandle, &handleCount);
-    check(!code);
-    if(handleCount) {
-        CURLMcode code = curl_multi_poll(nst->multiHandle, 0, 0, 300, 0);
+    if(nst->timerDeadline < wakeTime) {
+        wakeTime = nst->timerDeadline;
+    }
+    int timeoutMs = getWaitMs(wakeTime);
+    struct epoll_event eventArray[EPOLL_EVENT_COUNT];
+    int eventCount =
+        epoll_wait(nst->epollFd, eventArray, EPOLL_EVENT_COUNT, timeoutMs);
+    for(int i = 0; i < eventCount; ++i) {
+        u32 events = eventArray[i].events;
+        int flags = ((events & EPOLLIN) ? CURL_CSELECT_IN : 0) |
+            ((events & EPOLLOUT) ? CURL_CSELECT_OUT : 0) |
+            ((events & (EPOLLERR|EPOLLHUP)) ? CURL_CSELECT_ERR : 0);
+        CURLMcode code = curl_multi_socket_action(nst->multiHandle,
+                eventArray[i].data.fd, flags, &nst->runningHandleCount);
+        check(!code);
+    }
+    if(nst->timerDeadline != NO_TIMER &&
+            getNanoseconds() >= nst->timerDeadline) {
+        // libcurl may set a new timer while it handles this one
+        nst->timerDeadline = NO_TIMER;
+        CURLMcode code = curl_multi_socket_action(nst->multiHandle,
+                CURL_SOCKET_TIMEOUT, 0, &nst->runningHandleCount);
         check(!code);
     }
 }
+#else
+static void
+waitForRequests(NetworkState *nst, u64 wakeTime)
+{
+    CURLMcode code =
+        curl_multi_perform(nst->multiHandle, &nst->runningHandleCount);
+    check(!code);
+    code = curl_multi_poll(nst->multiHandle, 0, 0, getWaitMs(wakeTime), 0);
+    check(!code);
+}
+#endif
 
 static u64
 getHandleIndex(NetworkState *nst, CURL *easyHandle)
@@ -779,13 +1878,17 @@ getHandleIndex(NetworkState *nst, CURL *easyHandle)
 
 static void
 processFinishedRequests(NetworkState *nst, JobQueue *jq,
-        AppMemory *memory, PlaylistArray *playlistArray)
+        AppMemory *memory, Manifest const *manifest,
+        PlaylistArray *playlistArray)
 {
     int msgCount = 0;
     CURLMsg *msg = 0;
     b32 mustRenewAccessToken = 0;
     do {
         Job job = {0};
+        MemoryArena *handleArena = 0;
+        MemoryArena *tapeArena = 0;
+        MemoryArena *csvArena = 0;
         msg = curl_multi_info_read(nst->multiHandle, &msgCount);
         if(msg) {
             check(msg->msg == CURLMSG_DONE &&
@@ -794,35 +1897,108 @@ processFinishedRequests(NetworkState *nst, JobQueue *jq,
                 (msg->msg == CURLMSG_DONE) ? msg->easy_handle : 0;
             if(easyHandle) {
                 u64 handleIndex = getHandleIndex(nst, easyHandle);
-                MemoryArena *handleArena = &nst->handleToArenaMap[handleIndex];
+                if(handleIndex == 0) {
+                    finishAccessTokenRenewal(nst, memory);
+                    removeEasyHandleFromMulti(nst, handleIndex);
+                    continue;
+                }
+                handleArena = &nst->handleToArenaMap[handleIndex];
+                tapeArena = &nst->handleToTapeArenaMap[handleIndex];
+                csvArena = &nst->handleToCsvArenaMap[handleIndex];
+                json_StreamParser *parser =
+                    &nst->handleToParserMap[handleIndex];
                 job = nst->handleToJobMap[handleIndex];
+                curl_off_t wireByteCount = 0;
+                curl_easy_getinfo(easyHandle, CURLINFO_SIZE_DOWNLOAD_T,
+                        &wireByteCount);
+                wireByteCount = (wireByteCount > 0) ? wireByteCount : 0;
+                Response const *response = &nst->handleToResponseMap[handleIndex];
+                nst->wireByteCount += wireByteCount;
+                nst->decodedByteCount += response->decodedByteCount;
+                nst->responseCount += 1;
+                if(response->isEncoded) {
+                    nst->encodedWireByteCount += wireByteCount;
+                    nst->encodedDecodedByteCount += response->decodedByteCount;
+                    nst->encodedResponseCount += 1;
+                }
+                long newConnectionCount = 0;
+                curl_easy_getinfo(easyHandle, CURLINFO_NUM_CONNECTS,
+                        &newConnectionCount);
+                nst->newConnectionCount += newConnectionCount;
+                curl_off_t firstByteTime = 0;
+                curl_easy_getinfo(easyHandle, CURLINFO_STARTTRANSFER_TIME_T,
+                        &firstByteTime);
+                if(!nst->firstByteRequestCount) {
+                    nst->firstByteMicroseconds = firstByteTime;
+                }
+                nst->firstByteTotalMicroseconds += firstByteTime;
+                nst->firstByteRequestCount += 1;
                 long responseCode = 0;
                 CURLcode c = curl_easy_getinfo(
                         easyHandle, CURLINFO_RESPONSE_CODE, &responseCode);
                 check(!c);
                 if(responseCode == EXPIRED_TOKEN_RESPONSE) {
-                    mustRenewAccessToken = 1;
-                    enqueueJob(jq, job);
+                    // requests sent before the last renewal just go again
+                    // with the new token
+                    if(job.tokenGeneration == nst->tokenGeneration) {
+                        mustRenewAccessToken = 1;
+                    }
+                    requeueJob(jq, job);
+                    job = (Job){0};
+                }
+                else if(responseCode == TOO_MANY_REQUESTS_RESPONSE) {
+                    // the job waits at the front of the queue until
+                    // spotify lets requests through again
+                    curl_off_t retryAfterSeconds = 0;
+                    curl_easy_getinfo(easyHandle, CURLINFO_RETRY_AFTER,
+                            &retryAfterSeconds);
+                    b32 isNewThrottling = throttleRateLimiter(
+                            &nst->rateLimiter,
+                            retryAfterSeconds > 0 ? retryAfterSeconds : 0);
+                    throttleConcurrentRequest(&nst->concurrency,
+                            isNewThrottling);
+                    requeueJob(jq, job);
                     job = (Job){0};
                 }
                 else if(responseCode != OK_RESPONSE) {
                     errorAndTerminate("problem while connecting with spotify");
                 }
-                Buffer text = {
-                    .data = handleArena->data,
-                    .count = handleArena->count
-                };
-                job.json = parseBufferToJson(&memory->scratch, text);
-                clearMemoryArena(handleArena);
+                else {
+                    curl_off_t latency = 0;
+                    curl_easy_getinfo(easyHandle, CURLINFO_TOTAL_TIME_T,
+                            &latency);
+                    recoverRateLimiter(&nst->rateLimiter);
+                    finishConcurrentRequest(&nst->concurrency,
+                            latency > 0 ? latency : 0);
+                }
+                if(job.type) {
+                    job.json = json_endStream(parser);
+                    if(!job.json.type) {
+                        errorAndTerminate("couldn't read spotify response");
+                    }
+                    job.csvRows = (Buffer){
+                        .data = csvArena->data,
+                        .count = csvArena->count,
+                    };
+                }
                 removeEasyHandleFromMulti(nst, handleIndex);
             }
         }
-        processJob(jq, memory, playlistArray, job);
-        clearMemoryArena(&memory->scratch);
+        TempMemory temp = beginTempMemory(&memory->scratch);
+        processJob(jq, memory, manifest, playlistArray, job);
+        endTempMemory(temp);
+        // the json tape and the CSV rows live in the handle's arenas
+        if(handleArena) {
+            ArenaPool *pool = &nst->responseArenaPool;
+            returnMemoryArena(pool, handleArena);
+            returnMemoryArena(pool, tapeArena);
+            returnMemoryArena(pool, csvArena);
+        }
     } while(msg);
 
     if(mustRenewAccessToken) {
-        renewAccessToken(nst, memory);
+        nst->isTokenRejected = 1;
+        beginAccessTokenRenewal(nst, memory);
     }
 }
 
@@ -831,32 +2007,80 @@ initNetworkState(NetworkState *nst, MemoryArena *arena)
 {
     nst->multiHandle = curl_multi_init();
     check(nst->multiHandle);
-
-    u64 easyCount = CONNECTION_COUNT + 1;
-    nst->easyHandleCount = easyCount;
-    nst->easyHandleArray = pushArray(arena, easyCount, CURL*);
-    for(u64 i = 0; i < easyCount; ++i) {
-        CURL *easy = curl_easy_init();
-        check(easy);
-        nst->easyHandleArray[i] = easy;
+    curl_multi_setopt(nst->multiHandle, CURLMOPT_PIPELINING,
+            CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(nst->multiHandle, CURLMOPT_MAX_HOST_CONNECTIONS,
+            (long)MAX_HOST_CONNECTION_COUNT);
+    curl_multi_setopt(nst->multiHandle, CURLMOPT_MAX_CONCURRENT_STREAMS,
+            (long)MAX_STREAM_COUNT);
+    // everything runs in this thread, so the share needs no locks
+    nst->share = curl_share_init();
+    check(nst->share);
+    curl_share_setopt(nst->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(nst->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(nst->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#if USE_EPOLL
+    nst->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(nst->epollFd < 0) {
+        errorAndTerminate("couldn't create the network event queue");
     }
-    
+    nst->timerDeadline = NO_TIMER;
+    curl_multi_setopt(nst->multiHandle, CURLMOPT_SOCKETFUNCTION,
+            watchSocketLibcurlCallback);
+    curl_multi_setopt(nst->multiHandle, CURLMOPT_SOCKETDATA, nst);
+    curl_multi_setopt(nst->multiHandle, CURLMOPT_TIMERFUNCTION,
+            setTimerLibcurlCallback);
+    curl_multi_setopt(nst->multiHandle, CURLMOPT_TIMERDATA, nst);
+#endif
+
+    // only the token handle exists at first, findFreeHandle creates the
+    // others as they're needed
+    u64 easyCount = MAX_CONNECTION_COUNT + 1;
+    nst->easyHandleArray = pushArray(arena, easyCount, CURL*);
+    nst->easyHandleArray[0] = createEasyHandle(nst);
+    nst->easyHandleCount = 1;
+
+
     nst->handleToJobMap      = pushArray(arena, easyCount, Job);
     nst->busyHandleFlagArray = pushArray(arena, easyCount, b32);
     nst->handleToArenaMap    = pushArray(arena, easyCount, MemoryArena);
-    for(u64 i = 0; i < easyCount; ++i) {
-        MemoryArena easyHandleArena = allocateMemoryArena(5*MEGABYTE);
-        nst->handleToArenaMap[i] = easyHandleArena;
-    }
+    nst->handleToTapeArenaMap = pushArray(arena, easyCount, MemoryArena);
+    nst->handleToCsvArenaMap = pushArray(arena, easyCount, MemoryArena);
+    nst->handleToResponseMap = pushArray(arena, easyCount, Response);
+    nst->handleToParserMap   = pushArray(arena, easyCount, json_StreamParser);
+    initJobProjections(nst, arena);
+    // each request in flight borrows three arenas
+    initArenaPool(&nst->responseArenaPool, arena, 3*MAX_CONNECTION_COUNT,
+            RESPONSE_ARENA_BYTE_COUNT, RESPONSE_ARENA_RESERVED_BYTE_COUNT);
+    nameArenaPool(&nst->responseArenaPool, "responses");
+    nst->handleToArenaMap[0] = allocateMemoryArenaInReserve(
+            RESPONSE_ARENA_BYTE_COUNT, RESPONSE_ARENA_RESERVED_BYTE_COUNT);
+    nameMemoryArena(&nst->handleToArenaMap[0], "token responses");
+    initRateLimiter(&nst->rateLimiter);
+    initConcurrencyController(&nst->concurrency);
 }
 
 static b32
-areAllHandlesBusy(NetworkState const *nst)
+isConcurrencyLimitReached(NetworkState const *nst)
 {
-    // the +1 is for the handle at index 0, which is reserved for special kinds
-    // of requests
-    check(nst->busyHandleCount + 1 <= nst->easyHandleCount);
-    return nst->busyHandleCount + 1 == nst->easyHandleCount;
+    // handle 0 is reserved for tokens and doesn't count
+    u64 busyCount =
+        nst->busyHandleCount - (nst->busyHandleFlagArray[0] ? 1 : 0);
+    return busyCount >= (u64)nst->concurrency.limit;
+}
+
+// A request is always let through while none is in flight, so a response
+// bigger than the whole budget still gets its turn
+static b32
+isResponseBudgetSpent(NetworkState const *nst)
+{
+    u64 byteCount = DEFAULT_RESPONSE_BYTE_COUNT;
+    for(u64 i = 1; i < nst->easyHandleCount; ++i) {
+        if(nst->busyHandleFlagArray[i]) {
+            byteCount += nst->handleToResponseMap[i].budgetByteCount;
+        }
+    }
+    return nst->busyHandleCount && byteCount > RESPONSE_BYTE_BUDGET;
 }
 
 int
@@ -868,13 +2092,22 @@ main(int argc, char **argv)
     // init state
     {
         initLibcurl(st);
+        initJsonKeys(&jsonKeys);
 
-        st->memory.curlBuffer = allocateMemoryArena(5*MEGABYTE);
         st->memory.persistent = allocateMemoryArena(5*MEGABYTE);
         st->memory.scratch    = allocateMemoryArena(5*MEGABYTE);
+        st->memory.tokens     = allocateMemoryArena(4*1024);
+        nameMemoryArena(&st->memory.persistent, "persistent");
+        nameMemoryArena(&st->memory.scratch, "scratch");
+        nameMemoryArena(&st->memory.tokens, "tokens");
+        initArenaPool(&st->memory.playlistArenaPool, &st->memory.persistent,
+                MAX_CONNECTION_COUNT, PLAYLIST_ARENA_BYTE_COUNT,
+                PLAYLIST_ARENA_RESERVED_BYTE_COUNT);
+        nameArenaPool(&st->memory.playlistArenaPool, "playlists");
 
         initNetworkState(&st->networkState, &st->memory.persistent);
-        initJobQueue(&st->jobQueue, 1024, &st->memory.persistent);
+        initJobQueue(&st->jobQueue, JOB_QUEUE_COUNT);
+        loadManifest(&st->manifest, &st->memory.persistent);
     }
 
     if(argc != 2) {
@@ -902,15 +2135,10 @@ main(int argc, char **argv)
         {
             Buffer text =
                 {.data = handleArena->data, .count = handleArena->count};
-            json_Element tokensJson =
-                parseBufferToJson(&st->memory.scratch, text);
-            json_Element error = json_getElement(tokensJson, CS("error"));
-            if(error.type) {
+            if(!getAccessTokensFromResponse(nst, &st->memory, text)) {
                 errorAndTerminate("invalid authorization code, "
                         "check if you copied it correctly");
             }
-            getAccessTokensFromJson(nst, &st->memory, tokensJson);
-            clearMemoryArena(&st->memory.scratch);
         }
     }
 
@@ -919,24 +2147,43 @@ main(int argc, char **argv)
     {
         Job job = {
             .type = Job_playlistListHeader,
-            .uri = CS(PLAYLIST_LIST_URI),
         };
         enqueueJob(jq, job);
     }
 
     while(!isJobQueueEmpty(jq) || nst->busyHandleCount) {
-        while(!isJobQueueEmpty(jq) && !areAllHandlesBusy(nst)) {
+        // renewing before the token expires keeps requests from being
+        // refused, they keep going with the old token in the meantime
+        if(getNanoseconds() >= nst->tokenRenewalDeadline) {
+            beginAccessTokenRenewal(nst, &st->memory);
+        }
+        // requests refused for their token wait in the queue for a new one
+        while(!nst->isTokenRejected && !isJobQueueEmpty(jq) &&
+                !isConcurrencyLimitReached(nst) && !isResponseBudgetSpent(nst) &&
+                canStartRequest(&nst->rateLimiter)) {
             Job job = dequeueJob(jq);
             addRequest(nst, &st->memory, jq, job);
         }
-        updateRequests(nst);
-        processFinishedRequests(nst, jq, &st->memory, &st->playlistArray);
-
-        if(isJobQueueEmpty(jq)) {
-            waitForRequests(nst);
+        // only the rate limiter can hold back requests without a transfer
+        // finishing first, so it's the only reason to wake up early
+        u64 wakeTime = NO_TIMER;
+        if(!nst->isTokenRejected && !isJobQueueEmpty(jq) &&
+                !isConcurrencyLimitReached(nst) && !isResponseBudgetSpent(nst)) {
+            wakeTime = getRateLimiterReadyTime(&nst->rateLimiter);
+        }
+        waitForRequests(nst, wakeTime);
+        // libcurl only has messages once some transfer is over
+        if((u64)nst->runningHandleCount < nst->busyHandleCount) {
+            processFinishedRequests(nst, jq, &st->memory, &st->manifest,
+                    &st->playlistArray);
         }
     }
 
+    writeManifest(&st->playlistArray);
+    printRateLimiterSummary(&nst->rateLimiter);
+    printConcurrencySummary(nst);
+    printTransferSummary(nst);
+    printMemorySummary();
     deinit(st);
 
     return 0;
@@ -1,26 +1,112 @@
 #define RESERVED_BYTE_COUNT (1ull << 36) 
 #define GUARD_SPACE_PAGE_COUNT 2
+// pops that leave more used bytes than this above the arena's top give their
+// pages back to the OS, smaller ones are zeroed only when they're reused
+#define DECOMMIT_THRESHOLD_BYTE_COUNT (1ull << 24)
+// used bytes are zeroed ahead of the arena's top in blocks this big, so small
+// pushes don't pay for a memset each
+#define ZEROING_BLOCK_BYTE_COUNT (1ull << 14)
+// arenas grow by mapping at least this many bytes at a time
+#define MAPPING_BLOCK_BYTE_COUNT (1ull << 16)
+// Build with -DARENA_HUGE_PAGES=1 to back arenas with transparent huge pages
+// where the OS supports them. Arenas then start at a huge page boundary, and
+// once one is a huge page big it grows by whole huge pages, so every block it
+// maps can be backed by them. Smaller arenas keep using normal pages.
+#ifndef ARENA_HUGE_PAGES
+#define ARENA_HUGE_PAGES 0
+#endif
+#define HUGE_PAGE_BYTE_COUNT (1ull << 21)
+// Build with -DARENA_STATS=1 to keep track of how named arenas are used, the
+// summary is printed to stderr at exit, or to the file in the ARENA_STATS
+// environment variable. Without it nothing is recorded.
+#ifndef ARENA_STATS
+#define ARENA_STATS 0
+#endif
+#define ARENA_STATS_MAX_NAME_COUNT 32
+
+#if ARENA_STATS
+// Shared by every arena with the same name
+typedef struct ArenaStats {
+    char const *name;
+    u64 arenaCount;
+    u64 pushCount;
+    u64 pushedByteCount;
+    u64 peakCount;
+    u64 growCount;
+    u64 mappingNanoseconds;
+    u64 zeroingNanoseconds;
+} ArenaStats;
+
+static ArenaStats arenaStatsArray[ARENA_STATS_MAX_NAME_COUNT];
+static u32 arenaStatsCount;
+#endif
 
 typedef struct MemoryArena {
     u8 *data;
     u64 count;
     u64 maxCount;
+    // bytes from count up to zeroCount are zero, the ones from there up to
+    // dirtyCount were used before and may not be
+    u64 zeroCount;
+    u64 dirtyCount;
+    // address space behind data, the arena can't grow past it
+    u64 reservedCount;
+    u32 tempCount;
+#if ARENA_STATS
+    ArenaStats *stats;
+#endif
 } MemoryArena;
 
+// Checkpoint of an arena, everything pushed after it is popped at once by
+// endTempMemory
+typedef struct TempMemory {
+    MemoryArena *arena;
+    u64 count;
+} TempMemory;
+
+static u64
+alignUp(u64 count, u64 alignment)
+{
+    return (count + alignment - 1) / alignment * alignment;
+}
+
+// byteCount bytes are mapped right away, reservedByteCount is the address
+// space the arena takes, guard pages included
 static MemoryArena
-allocateMemoryArena(u64 byteCount)
+allocateMemoryArenaInReserve(u64 byteCount, u64 reservedByteCount)
 {
     MemoryArena arena = {0};
     u64 pageByteCount = getVirtualPageByteCount();
     u64 guardSpaceByteCount = GUARD_SPACE_PAGE_COUNT * pageByteCount;
-    b32 enoughSpace = (RESERVED_BYTE_COUNT - guardSpaceByteCount >= byteCount);
+    b32 enoughSpace = (reservedByteCount - guardSpaceByteCount >= byteCount);
     if(enoughSpace) {
-        u8 *begin = reserveVirtualMemory(RESERVED_BYTE_COUNT);
-        u8 *guardPage = begin;
-        u8 *arenaData = guardPage + pageByteCount;
+#if ARENA_HUGE_PAGES
+        u64 alignment = HUGE_PAGE_BYTE_COUNT;
+#else
+        u64 alignment = pageByteCount;
+#endif
+        // some extra space is reserved to align the data, it's given back
+        // right away
+        u8 *begin = reserveVirtualMemory(reservedByteCount + alignment);
+        u8 *arenaData =
+            (u8*)alignUp((u64)begin + pageByteCount, alignment);
+        u8 *guardPage = arenaData - pageByteCount;
+        u8 *end = guardPage + reservedByteCount;
+        if(guardPage != begin) {
+            freeVirtualMemory(begin, guardPage - begin);
+        }
+        freeVirtualMemory(end, begin + reservedByteCount + alignment - end);
+#if ARENA_HUGE_PAGES
+        adviseHugePages(arenaData, reservedByteCount - guardSpaceByteCount);
+#endif
+        byteCount = alignUp(byteCount, pageByteCount);
         b32 error = mapReservedMemory(arenaData, byteCount);
         if(!error) {
-            arena = (MemoryArena){.data = arenaData, .maxCount = byteCount};
+            arena = (MemoryArena){
+                .data = arenaData,
+                .maxCount = byteCount,
+                .reservedCount = reservedByteCount - guardSpaceByteCount,
+            };
         }
         else {
             check(0 && "couldn't map memory");
@@ -34,20 +120,48 @@ allocateMemoryArena(u64 byteCount)
     return arena;
 }
 
+static MemoryArena
+allocateMemoryArena(u64 byteCount)
+{
+    return allocateMemoryArenaInReserve(byteCount, RESERVED_BYTE_COUNT);
+}
+
 static b32
 growMemoryArena(MemoryArena *arena, u64 count)
 {
     b32 ret = 0;
-    u64 guardSpaceByteCount =
-        GUARD_SPACE_PAGE_COUNT * getVirtualPageByteCount();
-    b32 enoughMemory = count < RESERVED_BYTE_COUNT - guardSpaceByteCount;
+    b32 enoughMemory = count <= arena->reservedCount;
     if(enoughMemory) {
-        b32 error = mapReservedMemory(arena->data, count);
-        if(error) {
-            check(0 && "couldn't map virtual memory");
-            panic(0, "not enought memory");
+        // only the tail that isn't mapped yet is mapped
+        u64 blockByteCount = MAPPING_BLOCK_BYTE_COUNT;
+#if ARENA_HUGE_PAGES
+        if(count >= HUGE_PAGE_BYTE_COUNT) {
+            blockByteCount = HUGE_PAGE_BYTE_COUNT;
         }
-        arena->maxCount = (count > arena->maxCount) ? count : arena->maxCount;
+#endif
+        u64 mappedCount = alignUp(arena->maxCount, getVirtualPageByteCount());
+        u64 newCount = alignUp(count, blockByteCount);
+        newCount = (newCount < arena->reservedCount) ?
+            newCount : arena->reservedCount;
+        if(newCount > mappedCount) {
+#if ARENA_STATS
+            u64 start = getNanoseconds();
+#endif
+            b32 error = mapReservedMemory(
+                    arena->data + mappedCount, newCount - mappedCount);
+            if(error) {
+                check(0 && "couldn't map virtual memory");
+                panic(0, "not enought memory");
+            }
+#if ARENA_STATS
+            if(arena->stats) {
+                arena->stats->growCount += 1;
+                arena->stats->mappingNanoseconds += getNanoseconds() - start;
+            }
+#endif
+        }
+        arena->maxCount = (newCount > arena->maxCount) ?
+            newCount : arena->maxCount;
     }
     else {
         check(0 && "not enought memory to grow arena");
@@ -62,7 +176,9 @@ freeMemoryArena(MemoryArena *arena)
 {
     u64 pageByteCount = getVirtualPageByteCount();
     u8 *guardPage = arena->data - pageByteCount;
-    b32 error = freeVirtualMemory(guardPage, RESERVED_BYTE_COUNT);
+    u64 guardSpaceByteCount = GUARD_SPACE_PAGE_COUNT * pageByteCount;
+    b32 error = freeVirtualMemory(guardPage,
+            arena->reservedCount + guardSpaceByteCount);
     if(error) {
         check(0 && "couldn't free virtual memory");
     }
@@ -78,41 +194,306 @@ pushToMemoryArena(MemoryArena *arena, u64 count)
         u64 requiredCount = arena->count + count;
         u64 newMax = (defaultCount > requiredCount) ?
             defaultCount : requiredCount;
+        if(newMax > arena->reservedCount &&
+                requiredCount <= arena->reservedCount) {
+            newMax = arena->reservedCount;
+        }
         enoughMemory = !growMemoryArena(arena, newMax);
     }
     if(enoughMemory) {
         reservedData = arena->data + arena->count;
         arena->count += count;
+        // pushed memory is always zero, popped bytes are cleared only here
+        if(arena->count > arena->zeroCount) {
+            if(arena->zeroCount < arena->dirtyCount) {
+#if ARENA_STATS
+                u64 start = getNanoseconds();
+#endif
+                u64 end = arena->zeroCount + ZEROING_BLOCK_BYTE_COUNT;
+                end = (end > arena->count) ? end : arena->count;
+                end = (end < arena->dirtyCount) ? end : arena->dirtyCount;
+                memset(arena->data + arena->zeroCount, 0,
+                        end - arena->zeroCount);
+                arena->zeroCount = end;
+#if ARENA_STATS
+                if(arena->stats) {
+                    arena->stats->zeroingNanoseconds +=
+                        getNanoseconds() - start;
+                }
+#endif
+            }
+            if(arena->count > arena->zeroCount) {
+                arena->zeroCount = arena->count;
+                arena->dirtyCount = arena->count;
+            }
+        }
+#if ARENA_STATS
+        ArenaStats *stats = arena->stats;
+        if(stats) {
+            stats->pushCount += 1;
+            stats->pushedByteCount += count;
+            if(arena->count > stats->peakCount) {
+                stats->peakCount = arena->count;
+            }
+        }
+#endif
     }
     return reservedData;
 }
 
+// Takes constant time unless the popped bytes go over
+// DECOMMIT_THRESHOLD_BYTE_COUNT
 static void
 popFromMemoryArena(MemoryArena *arena, u64 count)
 {
     b32 enoughMemory = (arena->count >= count);
     if(!enoughMemory) {
-        check("popping more memory than it's avaiable in arena");
+        check(0 && "popping more memory than it's avaiable in arena");
     }
     count = enoughMemory ? count : arena->count;
     arena->count -= count;
-    u8 *base = arena->data + arena->count;
-    for(u64 i = 0; i < count; ++i) {
-        base[i] = 0;
+    arena->zeroCount = arena->count;
+    if(arena->dirtyCount - arena->count >= DECOMMIT_THRESHOLD_BYTE_COUNT) {
+        u64 pageByteCount = getVirtualPageByteCount();
+        u64 firstPage = alignUp(arena->count, pageByteCount);
+        u64 endPage = alignUp(arena->dirtyCount, pageByteCount);
+#if ARENA_STATS
+        u64 start = getNanoseconds();
+#endif
+        b32 error =
+            decommitVirtualMemory(arena->data + firstPage, endPage - firstPage);
+        if(!error) {
+            arena->dirtyCount = firstPage;
+        }
+#if ARENA_STATS
+        if(arena->stats) {
+            arena->stats->mappingNanoseconds += getNanoseconds() - start;
+        }
+#endif
     }
 }
 
 static void
 clearMemoryArena(MemoryArena *arena)
 {
+    check(!arena->tempCount && "clearing an arena that has checkpoints");
     popFromMemoryArena(arena, arena->count);
 }
 
+static TempMemory
+beginTempMemory(MemoryArena *arena)
+{
+    TempMemory temp = {.arena = arena, .count = arena->count};
+    arena->tempCount += 1;
+    return temp;
+}
+
+static void
+endTempMemory(TempMemory temp)
+{
+    MemoryArena *arena = temp.arena;
+    check(arena->count >= temp.count);
+    check(arena->tempCount > 0);
+    popFromMemoryArena(arena, arena->count - temp.count);
+    arena->tempCount -= 1;
+}
+
+#if ARENA_STATS
+static ArenaStats*
+getArenaStats(char const *name)
+{
+    ArenaStats *stats = 0;
+    for(u32 i = 0; i < arenaStatsCount && !stats; ++i) {
+        if(strcmp(arenaStatsArray[i].name, name) == 0) {
+            stats = &arenaStatsArray[i];
+        }
+    }
+    if(!stats && arenaStatsCount < ARENA_STATS_MAX_NAME_COUNT) {
+        stats = &arenaStatsArray[arenaStatsCount];
+        arenaStatsCount += 1;
+        stats->name = name;
+    }
+    return stats;
+}
+
+// What the arena had pushed before being named isn't counted
+static void
+nameMemoryArena(MemoryArena *arena, char const *name)
+{
+    arena->stats = getArenaStats(name);
+    if(arena->stats) {
+        arena->stats->arenaCount += 1;
+        if(arena->count > arena->stats->peakCount) {
+            arena->stats->peakCount = arena->count;
+        }
+    }
+}
+
+static void
+reportArenaStats(void)
+{
+    char const *path = getenv("ARENA_STATS");
+    FILE *file = (path && path[0]) ? fopen(path, "w") : 0;
+    FILE *out = file ? file : stderr;
+    fprintf(out, "%-20s %8s %10s %12s %12s %6s %10s %10s\n",
+            "arena", "arenas", "pushes", "pushed KB", "peak KB", "grows",
+            "map ms", "zero ms");
+    for(u32 i = 0; i < arenaStatsCount; ++i) {
+        ArenaStats *stats = &arenaStatsArray[i];
+        fprintf(out, "%-20s %8llu %10llu %12.1f %12.1f %6llu %10.3f %10.3f\n",
+                stats->name,
+                (unsigned long long)stats->arenaCount,
+                (unsigned long long)stats->pushCount,
+                stats->pushedByteCount / 1024.0,
+                stats->peakCount / 1024.0,
+                (unsigned long long)stats->growCount,
+                stats->mappingNanoseconds / 1e6,
+                stats->zeroingNanoseconds / 1e6);
+    }
+    if(file) {
+        fclose(file);
+    }
+}
+#else
+#define nameMemoryArena(arena, name)
+#define reportArenaStats()
+#endif
+
+// Arenas the pool creates are all named after it
+#if ARENA_STATS
+#define \
+nameArenaPool(pool, name) ((pool)->stats = getArenaStats(name))
+#else
+#define nameArenaPool(pool, name)
+#endif
+
+// Arenas start page aligned, but bytes pushed before may have left the top
+// unaligned for the type
+static u8*
+pushAlignedToMemoryArena(MemoryArena *arena, u64 count, u64 alignment)
+{
+    u64 padding = (alignment - arena->count%alignment)%alignment;
+    if(padding && !pushToMemoryArena(arena, padding)) {
+        return 0;
+    }
+    return pushToMemoryArena(arena, count);
+}
+
 #define \
 pushStruct(arena, type) \
-    ((type*)pushToMemoryArena((arena),(sizeof(type))))
+    ((type*)pushAlignedToMemoryArena((arena),(sizeof(type)),_Alignof(type)))
 
 #define \
 pushArray(arena, count, type) \
-    ((type*)pushToMemoryArena((arena),(count)*sizeof(type)))
+    ((type*)pushAlignedToMemoryArena((arena),(count)*sizeof(type), \
+        _Alignof(type)))
+
+
+// Gives back the memory of an empty arena past its first byteCount bytes,
+// the address space stays reserved for it to grow again
+static void
+shrinkMemoryArena(MemoryArena *arena, u64 byteCount)
+{
+    check(!arena->count && "shrinking an arena that's in use");
+    u64 pageByteCount = getVirtualPageByteCount();
+    byteCount = alignUp(byteCount, pageByteCount);
+    u64 mappedCount = alignUp(arena->maxCount, pageByteCount);
+    if(mappedCount > byteCount) {
+#if ARENA_STATS
+        u64 start = getNanoseconds();
+#endif
+        b32 error = unmapReservedMemory(
+                arena->data + byteCount, mappedCount - byteCount);
+#if ARENA_STATS
+        if(arena->stats) {
+            arena->stats->mappingNanoseconds += getNanoseconds() - start;
+        }
+#endif
+        if(!error) {
+            arena->maxCount = byteCount;
+            if(arena->dirtyCount > byteCount) {
+                arena->dirtyCount = byteCount;
+            }
+            arena->zeroCount = 0;
+        }
+    }
+}
+
+// Arenas lent to short lived users and taken back once they're done, so the
+// memory they take follows how many are in use at the same time. New arenas
+// start with arenaByteCount bytes and get back to that when they're returned.
+typedef struct ArenaPool {
+    MemoryArena *freeArenaArray;
+    u64 freeCount;
+    u64 maxFreeCount;
+    u64 arenaByteCount;
+    u64 reservedByteCount;
+    u64 lentCount;
+    u64 maxLentCount;
+#if ARENA_STATS
+    ArenaStats *stats;
+#endif
+} ArenaPool;
+
+static void
+initArenaPool(ArenaPool *pool, MemoryArena *arena, u64 maxFreeCount,
+        u64 arenaByteCount, u64 reservedByteCount)
+{
+    *pool = (ArenaPool){
+        .freeArenaArray = pushArray(arena, maxFreeCount, MemoryArena),
+        .maxFreeCount = maxFreeCount,
+        .arenaByteCount = arenaByteCount,
+        .reservedByteCount = reservedByteCount,
+    };
+}
 
+static MemoryArena
+borrowMemoryArena(ArenaPool *pool)
+{
+    MemoryArena arena = {0};
+    if(pool->freeCount) {
+        pool->freeCount -= 1;
+        arena = pool->freeArenaArray[pool->freeCount];
+    }
+    else {
+        arena = allocateMemoryArenaInReserve(
+                pool->arenaByteCount, pool->reservedByteCount);
+#if ARENA_STATS
+        arena.stats = pool->stats;
+        if(arena.stats) {
+            arena.stats->arenaCount += 1;
+        }
+#endif
+    }
+    pool->lentCount += 1;
+    if(pool->lentCount > pool->maxLentCount) {
+        pool->maxLentCount = pool->lentCount;
+    }
+    return arena;
+}
+
+static void
+returnMemoryArena(ArenaPool *pool, MemoryArena *arena)
+{
+    check(pool->lentCount > 0);
+    pool->lentCount -= 1;
+    clearMemoryArena(arena);
+    if(pool->freeCount < pool->maxFreeCount) {
+        shrinkMemoryArena(arena, pool->arenaByteCount);
+        pool->freeArenaArray[pool->freeCount] = *arena;
+        pool->freeCount += 1;
+    }
+    else {
+        freeMemoryArena(arena);
+    }
+    *arena = (MemoryArena){0};
+}
+
+static void
+freeArenaPool(ArenaPool *pool)
+{
+    for(u64 i = 0; i < pool->freeCount; ++i) {
+        freeMemoryArena(&pool->freeArenaArray[i]);
+    }
+    pool->freeCount = 0;
+}
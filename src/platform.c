@@ -26,6 +26,39 @@
 
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+
+u64
+getNanoseconds()
+{
+    struct timespec time = {0};
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64)time.tv_sec * 1000000000ull + (u64)time.tv_nsec;
+}
+
+// Most memory the process has had resident at once so far
+u64
+getPeakResidentByteCount()
+{
+    struct rusage usage = {0};
+    getrusage(RUSAGE_SELF, &usage);
+#if MAC_OS
+    // macOS counts bytes, the others count kilobytes
+    return (u64)usage.ru_maxrss;
+#else
+    return (u64)usage.ru_maxrss * 1024;
+#endif
+}
+
+// Page faults of the process so far, counting the ones served without I/O
+u64
+getPageFaultCount()
+{
+    struct rusage usage = {0};
+    getrusage(RUSAGE_SELF, &usage);
+    return (u64)usage.ru_minflt + (u64)usage.ru_majflt;
+}
 
 u64
 getVirtualPageByteCount()
@@ -49,6 +82,45 @@ mapReservedMemory(u8 *data, u64 byteCount)
     return error ? 1 : 0;
 }
 
+// Takes the pages back to the state reserveVirtualMemory left them in
+b32
+unmapReservedMemory(u8 *data, u64 byteCount)
+{
+    u8 *newData = mmap(data, byteCount, PROT_NONE,
+            MAP_FIXED|MAP_ANON|MAP_PRIVATE, -1, 0);
+    return (newData == MAP_FAILED) ? 1 : 0;
+}
+
+// The pages stay mapped, but their memory goes back to the OS and they read
+// as zero the next time they're touched
+b32
+decommitVirtualMemory(u8 *data, u64 byteCount)
+{
+#if LINUX
+    int error = madvise(data, byteCount, MADV_DONTNEED);
+#else
+    u8 *newData = mmap(data, byteCount, PROT_READ|PROT_WRITE,
+            MAP_FIXED|MAP_ANON|MAP_PRIVATE, -1, 0);
+    int error = (newData == MAP_FAILED);
+#endif
+    return error ? 1 : 0;
+}
+
+// Asks for the memory to be backed by huge pages when the OS can, it's only a
+// hint
+b32
+adviseHugePages(u8 *data, u64 byteCount)
+{
+#if LINUX && defined(MADV_HUGEPAGE)
+    int error = madvise(data, byteCount, MADV_HUGEPAGE);
+#else
+    (void)data;
+    (void)byteCount;
+    int error = 1;
+#endif
+    return error ? 1 : 0;
+}
+
 b32
 freeVirtualMemory(u8 *data, u64 byteCount)
 {
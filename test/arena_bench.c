@@ -0,0 +1,118 @@
+// Grows one arena to a few hundred MB in small pushes, then reads random bytes
+// from it, and reports the time, page faults and data TLB misses of each part.
+// test/arena_bench.sh builds it with and without huge pages:
+//   cc -O3 -Isrc/ -o arena_bench test/arena_bench.c
+//   cc -O3 -DARENA_HUGE_PAGES=1 -Isrc/ -o arena_bench test/arena_bench.c
+//
+// TLB misses are read from the CPU's counters through perf_event_open, they
+// are reported as n/a where the kernel doesn't expose them.
+//
+// usage: arena_bench [megabyteCount] [readCount]
+
+#include "includes.c"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define PUSH_BYTE_COUNT 256
+
+// Returns a counter of this process' data TLB load misses, or -1
+static int
+openTlbMissCounter(void)
+{
+    int fd = -1;
+#if defined(__linux__)
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    return fd;
+}
+
+static u64
+readCounter(int fd)
+{
+    u64 count = 0;
+    if(fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count)) {
+        count = 0;
+    }
+    return count;
+}
+
+typedef struct Sample {
+    u64 nanoseconds;
+    u64 pageFaultCount;
+    u64 tlbMissCount;
+} Sample;
+
+static Sample
+takeSample(int tlbMissCounter)
+{
+    Sample sample = {
+        .nanoseconds = getNanoseconds(),
+        .pageFaultCount = getPageFaultCount(),
+        .tlbMissCount = readCounter(tlbMissCounter),
+    };
+    return sample;
+}
+
+static void
+printSampleDifference(char const *name, Sample start, Sample end,
+        int tlbMissCounter)
+{
+    printf("  %-8s %8.1f ms %10llu page faults", name,
+            (end.nanoseconds - start.nanoseconds) / 1e6,
+            (unsigned long long)(end.pageFaultCount - start.pageFaultCount));
+    if(tlbMissCounter >= 0) {
+        printf(" %12llu dTLB load misses\n",
+                (unsigned long long)(end.tlbMissCount - start.tlbMissCount));
+    }
+    else {
+        printf("          n/a dTLB load misses\n");
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    u64 byteCount = ((argc > 1) ? strtoull(argv[1], 0, 10) : 512) << 20;
+    u64 readCount = (argc > 2) ? strtoull(argv[2], 0, 10) : 20000000;
+    int tlbMissCounter = openTlbMissCounter();
+    printf("%s pages, %llu MB in %d byte pushes, %llu random reads:\n",
+            ARENA_HUGE_PAGES ? "huge" : "normal",
+            (unsigned long long)(byteCount >> 20), PUSH_BYTE_COUNT,
+            (unsigned long long)readCount);
+
+    Sample start = takeSample(tlbMissCounter);
+    MemoryArena arena = allocateMemoryArena(1 << 16);
+    for(u64 i = 0; i < byteCount; i += PUSH_BYTE_COUNT) {
+        u8 *data = pushToMemoryArena(&arena, PUSH_BYTE_COUNT);
+        data[0] = (u8)i;
+    }
+    Sample pushed = takeSample(tlbMissCounter);
+    printSampleDifference("pushes", start, pushed, tlbMissCounter);
+
+    u64 state = 0x9e3779b97f4a7c15ull;
+    u64 sum = 0;
+    for(u64 i = 0; i < readCount; ++i) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        sum += arena.data[state % byteCount];
+    }
+    Sample read = takeSample(tlbMissCounter);
+    printSampleDifference("reads", pushed, read, tlbMissCounter);
+
+    freeMemoryArena(&arena);
+    // keeps the reads from being optimized away
+    return (sum == 1) ? 2 : 0;
+}
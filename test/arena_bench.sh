@@ -0,0 +1,19 @@
+#!/bin/sh
+# Builds test/arena_bench.c with normal and with huge pages and runs both.
+#
+# usage: sh test/arena_bench.sh [megabyteCount] [readCount]
+
+set -e
+
+compiler="${compiler-cc}"
+cflags="${cflags-}"
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+for hugePages in 0 1; do
+    $compiler -O3 $cflags -DARENA_HUGE_PAGES=$hugePages \
+        -I"$root" -I"$root/src" -o "$work/arena_bench" "$root/test/arena_bench.c"
+    "$work/arena_bench" "$@"
+done
@@ -0,0 +1,88 @@
+// Throughput of the buffered JSON parser on a synthetic page of tracks, see
+// test/spotify_page.c. test/json_bench.sh builds it with each variant of the
+// structural index stage:
+//   cc -O3 -Isrc/ -o json_bench test/json_bench.c                 (SSE2)
+//   cc -O3 -mavx2 -Isrc/ -o json_bench test/json_bench.c          (AVX2)
+//   cc -O3 -DJSON_SIMD=0 -Isrc/ -o json_bench test/json_bench.c   (scalar)
+//
+// usage: json_bench [trackCount] [iterationCount]
+
+#include <stdarg.h>
+#include "includes.c"
+#include "spotify_page.c"
+
+#if !defined(VECTOR_SIZE)
+#define VARIANT "scalar"
+#elif VECTOR_SIZE == 32
+#define VARIANT "AVX2"
+#else
+#define VARIANT "SSE2"
+#endif
+
+typedef enum BenchStage {
+    BenchStage_structuralIndex,
+    BenchStage_parseJson,
+    BenchStage_parseJsonInPlace,
+    BenchStage_count,
+} BenchStage;
+
+static char const *const benchStageNameArray[BenchStage_count] = {
+    "structural index",
+    "json_parseJson",
+    "json_parseJsonInPlace",
+};
+
+// Returns the best time of iterationCount runs of stage over page, in
+// nanoseconds
+static u64
+runBenchStage(MemoryArena *arena, Buffer page, BenchStage stage,
+        u64 iterationCount)
+{
+    u64 bestTime = ~0ull;
+    for(u64 i = 0; i < iterationCount; ++i) {
+        u64 start = getNanoseconds();
+        b32 ok = 0;
+        switch(stage) {
+            case BenchStage_structuralIndex: {
+                ok = (buildStructuralIndex(arena, page).count != 0);
+            } break;
+            case BenchStage_parseJson: {
+                ok = (json_parseJson(arena, page).type == json_OBJECT);
+            } break;
+            case BenchStage_parseJsonInPlace: {
+                ok = (json_parseJsonInPlace(arena, page).type == json_OBJECT);
+            } break;
+            case BenchStage_count: break;
+        }
+        clearMemoryArena(arena);
+        u64 time = getNanoseconds() - start;
+        if(!ok) {
+            fprintf(stderr, "ERROR: %s failed\n", benchStageNameArray[stage]);
+            exit(1);
+        }
+        bestTime = (time < bestTime) ? time : bestTime;
+    }
+    return bestTime;
+}
+
+int
+main(int argc, char **argv)
+{
+    u64 trackCount = (argc > 1) ? strtoull(argv[1], 0, 10) : 100;
+    u64 iterationCount = (argc > 2) ? strtoull(argv[2], 0, 10) : 200;
+    MemoryArena pageArena = allocateMemoryArena(1 << 20);
+    MemoryArena arena = allocateMemoryArena(1 << 20);
+    Buffer page = makeTrackPage(&pageArena, trackCount);
+    printf("%s, %llu tracks, %llu KB, best of %llu:\n", VARIANT,
+            (unsigned long long)trackCount,
+            (unsigned long long)page.count/1024,
+            (unsigned long long)iterationCount);
+    for(BenchStage stage = 0; stage < BenchStage_count; ++stage) {
+        u64 time = runBenchStage(&arena, page, stage, iterationCount);
+        printf("  %-22s %7.1f MB/s\n", benchStageNameArray[stage],
+                (f64)page.count*1e3/(f64)time);
+    }
+    freeMemoryArena(&arena);
+    freeMemoryArena(&pageArena);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Builds test/json_bench.c with the scalar, SSE2 and AVX2 structural index
+# stages and runs each of them on the same synthetic page of tracks.
+#
+# usage: sh test/json_bench.sh [trackCount] [iterationCount]
+
+set -e
+
+compiler="${compiler-cc}"
+cflags="${cflags-}"
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+build() {
+    $compiler -O3 $cflags "$@" -I"$root" -I"$root/src" \
+        -o "$work/json_bench" "$root/test/json_bench.c"
+}
+
+build -DJSON_SIMD=0
+"$work/json_bench" "$@"
+build
+"$work/json_bench" "$@"
+if grep -q avx2 /proc/cpuinfo 2>/dev/null; then
+    build -mavx2
+    "$work/json_bench" "$@"
+fi
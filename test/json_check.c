@@ -0,0 +1,237 @@
+// Parses the same documents with json_parseJson, json_parseJsonInPlace and the
+// streaming parser, fed in pieces of several sizes, and checks that they all
+// build the same tape, or all reject the document. It also checks that
+// json_printElement reports what it can't print. test/test.sh runs it.
+//
+// usage: json_check
+
+#include <stdarg.h>
+#include "includes.c"
+#include "spotify_page.c"
+
+typedef enum ParseMode {
+    ParseMode_copy,
+    ParseMode_inPlace,
+    ParseMode_streamWhole,
+    ParseMode_stream4096,
+    ParseMode_stream7,
+    ParseMode_stream1,
+    ParseMode_count,
+} ParseMode;
+
+static char const *const parseModeNameArray[ParseMode_count] = {
+    "json_parseJson",
+    "json_parseJsonInPlace",
+    "stream in one piece",
+    "stream in 4096 byte pieces",
+    "stream in 7 byte pieces",
+    "stream in 1 byte pieces",
+};
+
+static u64 const streamPieceCountArray[ParseMode_count] = {
+    [ParseMode_stream4096] = 4096,
+    [ParseMode_stream7] = 7,
+    [ParseMode_stream1] = 1,
+};
+
+static u64 failureCount;
+
+static json_Element
+parseWithMode(MemoryArena *tapeArena, MemoryArena *stringArena, Buffer text,
+        ParseMode mode)
+{
+    json_Element root = {0};
+    if(mode == ParseMode_copy) {
+        root = json_parseJson(tapeArena, text);
+    }
+    else if(mode == ParseMode_inPlace) {
+        root = json_parseJsonInPlace(tapeArena, text);
+    }
+    else {
+        json_StreamParser parser;
+        json_beginStream(&parser, tapeArena, stringArena, 0, 0);
+        u64 pieceCount = streamPieceCountArray[mode];
+        pieceCount = pieceCount ? pieceCount : text.count;
+        b32 ok = 1;
+        for(u64 offset = 0; ok && offset < text.count; offset += pieceCount) {
+            u64 count = text.count - offset;
+            count = (count < pieceCount) ? count : pieceCount;
+            ok = json_feedStream(&parser,
+                    (Buffer){.data = text.data + offset, .count = count});
+        }
+        if(ok) {
+            root = json_endStream(&parser);
+        }
+    }
+    return root;
+}
+
+// Compares a and the siblings that come after it with b and its siblings
+static b32
+areElementsEqual(json_Element a, json_Element b)
+{
+    for(;;) {
+        if(a.type != b.type || !areEqual(a.label, b.label)) {
+            return 0;
+        }
+        if(!a.type) {
+            return 1;
+        }
+        switch(a.type) {
+            case json_STRING: {
+                if(!areEqual(a.value, b.value)) {
+                    return 0;
+                }
+            } break;
+            case json_NUMBER: {
+                f64 aNumber = json_getNumber(a);
+                f64 bNumber = json_getNumber(b);
+                if(!areEqual(a.value, b.value) ||
+                        memcmp(&aNumber, &bNumber, sizeof(f64)) ||
+                        json_getInteger(a) != json_getInteger(b)) {
+                    return 0;
+                }
+            } break;
+            case json_ARRAY:
+            case json_OBJECT: {
+                if(a.entry->count != b.entry->count ||
+                        a.entry->span != b.entry->span ||
+                        !areElementsEqual(json_getFirstSubElement(a),
+                            json_getFirstSubElement(b))) {
+                    return 0;
+                }
+            } break;
+            default: break;
+        }
+        a = json_getNextSibling(a);
+        b = json_getNextSibling(b);
+    }
+}
+
+// Checks that every parse mode gives the same tape as json_parseJson, or that
+// they all fail when isValid is zero
+static void
+checkDocument(char const *name, Buffer text, b32 isValid)
+{
+    MemoryArena tapeArena = allocateMemoryArena(1 << 16);
+    MemoryArena stringArena = allocateMemoryArena(1 << 16);
+    MemoryArena expectedArena = allocateMemoryArena(1 << 16);
+    json_Element expected = json_parseJson(&expectedArena, text);
+    if((expected.type != json_INVALID_ELEMENT) != isValid) {
+        fprintf(stderr, "FAIL: %s: json_parseJson %s it\n", name,
+                isValid ? "rejected" : "accepted");
+        failureCount += 1;
+    }
+    for(ParseMode mode = ParseMode_inPlace; mode < ParseMode_count; ++mode) {
+        json_Element root =
+            parseWithMode(&tapeArena, &stringArena, text, mode);
+        if(!areElementsEqual(expected, root)) {
+            fprintf(stderr, "FAIL: %s: %s differs from json_parseJson\n", name,
+                    parseModeNameArray[mode]);
+            failureCount += 1;
+        }
+        clearMemoryArena(&tapeArena);
+        clearMemoryArena(&stringArena);
+    }
+    freeMemoryArena(&expectedArena);
+    freeMemoryArena(&stringArena);
+    freeMemoryArena(&tapeArena);
+}
+
+// Nests depth arrays, with a number in the innermost one
+static Buffer
+makeNestedDocument(MemoryArena *arena, u64 depth)
+{
+    Buffer text = allocateBuffer(arena, 2*depth + 1);
+    memset(text.data, '[', depth);
+    text.data[depth] = '1';
+    memset(text.data + depth + 1, ']', depth);
+    return text;
+}
+
+// json_printElement must print every level of a document the parsers accept,
+// and say so when a tape is deeper than that
+static void
+checkPrinting(MemoryArena *arena)
+{
+    json_Element deepest = json_parseJson(arena,
+            makeNestedDocument(arena, JSON_MAX_DEPTH));
+    if(!json_printElement(deepest)) {
+        fprintf(stderr, "FAIL: JSON_MAX_DEPTH lists weren't printed whole\n");
+        failureCount += 1;
+    }
+    // no parser builds this tape, the arrays are nested one level too deep
+    u64 tapeCount = JSON_MAX_DEPTH + 1;
+    json_TapeEntry *tape = pushArray(arena, tapeCount, json_TapeEntry);
+    for(u64 i = 0; i < tapeCount; ++i) {
+        tape[i] = (json_TapeEntry){
+            .type = json_ARRAY,
+            .count = (i + 1 < tapeCount) ? 1 : 0,
+            .span = tapeCount - i,
+        };
+    }
+    if(json_printElement(makeRootElement(tape, tapeCount))) {
+        fprintf(stderr, "FAIL: a tape nested too deeply was printed whole\n");
+        failureCount += 1;
+    }
+}
+
+int
+main(void)
+{
+    char const *const validDocumentArray[] = {
+        "{}",
+        "[]",
+        " [ 1 , -2.5e3 , 0 , 1E+2 , 12345678901234567890 ] ",
+        "{\"a\": {\"b\": [true, false, null]}, \"c\": \"\\\"\\u00e9\\\\\"}",
+        "[[[], {}], [{\"\": \"\"}]]",
+        "{\"k0\":0,\"k1\":1,\"k2\":2,\"k3\":3,\"k4\":4,\"k5\":5,\"k6\":6,"
+            "\"k7\":7,\"k8\":{\"x\":[1,2,3]},\"k9\":\"\\/\"}",
+        "[\"caf\xc3\xa9\", \"\xe6\x97\xa5\xe6\x9c\xac\", \"a\\\\\", \"\\\\\\\"\"]",
+        // every parser ignores what comes after the top list
+        "[1]]",
+    };
+    char const *const invalidDocumentArray[] = {
+        "",
+        "1",
+        "[",
+        "[1,]",
+        "[1 2]",
+        "{\"a\" 1}",
+        "{\"a\": 1,}",
+        "{1: 2}",
+        "[-]",
+        "[1.]",
+        "[1e]",
+        "{\"a\": 1.}",
+        "[tru]",
+        "[\"unterminated]",
+        "[}",
+    };
+    for(u64 i = 0; i < sizeof(validDocumentArray)/sizeof(char*); ++i) {
+        char const *text = validDocumentArray[i];
+        checkDocument(text,
+                (Buffer){.data = (u8*)text, .count = strlen(text)}, 1);
+    }
+    for(u64 i = 0; i < sizeof(invalidDocumentArray)/sizeof(char*); ++i) {
+        char const *text = invalidDocumentArray[i];
+        checkDocument(text,
+                (Buffer){.data = (u8*)text, .count = strlen(text)}, 0);
+    }
+
+    MemoryArena arena = allocateMemoryArena(1 << 20);
+    checkDocument("page of tracks", makeTrackPage(&arena, 100), 1);
+    checkDocument("JSON_MAX_DEPTH lists",
+            makeNestedDocument(&arena, JSON_MAX_DEPTH), 1);
+    checkDocument("JSON_MAX_DEPTH + 1 lists",
+            makeNestedDocument(&arena, JSON_MAX_DEPTH + 1), 0);
+    checkPrinting(&arena);
+    freeMemoryArena(&arena);
+
+    if(failureCount) {
+        fprintf(stderr, "%llu checks failed\n",
+                (unsigned long long)failureCount);
+        return 1;
+    }
+    return 0;
+}
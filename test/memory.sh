@@ -0,0 +1,19 @@
+#!/bin/sh
+# Runs test/test.sh on a 500 playlist library, throttled by the stand-in, to
+# report how much memory a whole download takes at its peak and how many page
+# faults it makes. It runs once with the default build and once with arenas on
+# huge pages (-DARENA_HUGE_PAGES=1).
+#
+# usage: sh test/memory.sh
+
+set -e
+
+cflags="${cflags-}"
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+
+for hugePages in 0 1; do
+    echo "ARENA_HUGE_PAGES=$hugePages:"
+    cflags="$cflags -DARENA_HUGE_PAGES=$hugePages" \
+        playlistCount="${playlistCount-500}" sh "$root/test/test.sh"
+done
@@ -0,0 +1,206 @@
+# Local stand-in for the parts of spotify's accounts and web APIs that
+# myspotifypl uses. It serves made up playlists, applies the "fields" and
+# "limit" parameters the way spotify does, and refuses GETs with 429 once they
+# go over --rate-limit per second. The CSVs myspotifypl should write for those
+# playlists are written to --expected before the server starts, except for
+# the ones that share their name with another playlist, since either of them
+# may end up in the file. Their names are listed in .shared there.
+# With --content-encoding gzip the bodies are compressed when the client
+# accepts it, with identity they only get a "Content-Encoding: identity".
+
+import argparse
+import gzip
+import json
+import os
+import random
+import re
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--port", type=int, default=8899)
+parser.add_argument("--playlists", type=int, default=60)
+parser.add_argument("--rate-limit", type=int, default=0,
+                    help="GETs per second before 429s, 0 for no limit")
+parser.add_argument("--shared-name-count", type=int, default=0,
+                    help="how many playlists share the first one's name")
+parser.add_argument("--content-encoding", default="none",
+                    choices=["none", "identity", "gzip"])
+parser.add_argument("--expected", required=True,
+                    help="directory for the expected CSVs")
+args = parser.parse_args()
+
+random.seed(1)
+playlists = [{"id": "pl%d" % i, "name": "Playlist %d" % i,
+              "trackCount": random.randint(0, 350)}
+             for i in range(args.playlists)]
+for playlist in playlists[1:1 + args.shared_name_count]:
+    playlist["name"] = playlists[0]["name"]
+
+
+def makeTrack(playlistIndex, trackIndex):
+    return {
+        "added_at": "2020-01-01T00:00:%02dZ" % (trackIndex % 60),
+        "track": {
+            "name": "Track \"%d\" of %d" % (trackIndex, playlistIndex),
+            "album": {"name": "Album %d" % trackIndex,
+                      "images": [{"url": "https://i.example/x"}] * 3},
+            "artists": [{"name": "Artist %d" % trackIndex, "id": "a"},
+                        {"name": "Band", "id": "b"}],
+            "duration_ms": 1000 * (trackIndex + 60) + 999,
+            "available_markets": ["US", "BR", "DE"] * 20,
+        },
+    }
+
+
+def makePage(playlistIndex, offset, limit):
+    count = playlists[playlistIndex]["trackCount"]
+    items = [makeTrack(playlistIndex, i)
+             for i in range(offset, min(count, offset + limit))]
+    return {"href": "h", "items": items, "limit": limit, "offset": offset,
+            "total": count}
+
+
+def parseFields(fields, i=0):
+    result = {}
+    while i < len(fields):
+        j = i
+        while j < len(fields) and fields[j] not in ",()":
+            j += 1
+        name = fields[i:j]
+        result[name] = None
+        if j < len(fields) and fields[j] == "(":
+            result[name], j = parseFields(fields, j + 1)
+        if j < len(fields) and fields[j] == ")":
+            return result, j + 1
+        i = j + 1 if j < len(fields) and fields[j] == "," else j
+    return result, i
+
+
+def project(value, fields):
+    if fields is None:
+        return value
+    if isinstance(value, list):
+        return [project(item, fields) for item in value]
+    if isinstance(value, dict):
+        return {k: project(value[k], f) for k, f in fields.items()
+                if k in value}
+    return value
+
+
+def writeExpectedCsvs(directory):
+    os.makedirs(directory, exist_ok=True)
+    names = [p["name"] for p in playlists]
+    shared = sorted(set(n for n in names if names.count(n) > 1))
+    with open(os.path.join(directory, ".shared"), "w") as file:
+        file.write("".join(n + ".csv\n" for n in shared))
+    for index, playlist in enumerate(playlists):
+        if playlist["name"] in shared:
+            continue
+        path = os.path.join(directory, playlist["name"] + ".csv")
+        with open(path, "w", newline="") as file:
+            file.write("title,album,artitsts,\"date added\",duration\n")
+            for item in makePage(index, 0, playlist["trackCount"])["items"]:
+                track = item["track"]
+                seconds = track["duration_ms"] // 1000
+                fields = [
+                    track["name"],
+                    track["album"]["name"],
+                    ",".join(a["name"] for a in track["artists"]),
+                    item["added_at"],
+                    "%02d:%02d:%02d" % (seconds // 3600, seconds // 60 % 60,
+                                        seconds % 60),
+                ]
+                file.write(",".join('"' + f.replace('"', '""') + '"'
+                                    for f in fields) + "\n")
+
+
+lock = threading.Lock()
+recentGets = []
+throttledCount = 0
+
+
+def isThrottled():
+    global throttledCount
+    if not args.rate_limit:
+        return False
+    with lock:
+        now = time.monotonic()
+        while recentGets and recentGets[0] < now - 1.0:
+            recentGets.pop(0)
+        if len(recentGets) >= args.rate_limit:
+            throttledCount += 1
+            with open(os.path.join(args.expected, ".throttled"), "w") as f:
+                f.write("%d\n" % throttledCount)
+            return True
+        recentGets.append(now)
+        return False
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *a):
+        pass
+
+    def sendEmpty(self, status, headers={}):
+        self.send_response(status)
+        for name, value in headers.items():
+            self.send_header(name, value)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def sendJson(self, value):
+        query = parse_qs(urlparse(self.path).query)
+        if "fields" in query:
+            value = project(value, parseFields(query["fields"][0])[0])
+        body = json.dumps(value).encode()
+        encoding = args.content_encoding
+        if encoding == "gzip":
+            accepted = self.headers.get("Accept-Encoding", "")
+            if "gzip" in accepted:
+                body = gzip.compress(body, 1)
+            else:
+                encoding = "none"
+        self.send_response(200)
+        if encoding != "none":
+            self.send_header("Content-Encoding", encoding)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_POST(self):
+        self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        self.sendJson({"access_token": "access", "refresh_token": "refresh",
+                       "expires_in": 3600})
+
+    def do_GET(self):
+        if isThrottled():
+            return self.sendEmpty(429, {"Retry-After": "1"})
+        url = urlparse(self.path)
+        query = parse_qs(url.query)
+        offset = int(query.get("offset", ["0"])[0])
+        if url.path == "/v1/me/playlists":
+            limit = min(int(query.get("limit", ["20"])[0]), 50)
+            items = [{"id": p["id"], "name": p["name"],
+                      "snapshot_id": "snapshot-" + p["id"],
+                      "images": [{"url": "https://i.example/y"}],
+                      "tracks": {"href": "h", "total": p["trackCount"]}}
+                     for p in playlists[offset:offset + limit]]
+            return self.sendJson({"items": items, "limit": limit,
+                                  "offset": offset, "total": len(playlists)})
+        match = re.fullmatch(r"/v1/playlists/pl(\d+)/tracks", url.path)
+        if match and int(match.group(1)) < len(playlists):
+            limit = min(int(query.get("limit", ["100"])[0]), 100)
+            return self.sendJson(makePage(int(match.group(1)), offset, limit))
+        self.sendEmpty(404)
+
+
+writeExpectedCsvs(args.expected)
+ThreadingHTTPServer.request_queue_size = 1024
+server = ThreadingHTTPServer(("127.0.0.1", args.port), Handler)
+open(os.path.join(args.expected, ".ready"), "w").close()
+server.serve_forever()
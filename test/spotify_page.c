@@ -0,0 +1,189 @@
+// Builds JSON text shaped like the pages of /v1/playlists/{id}/tracks, with
+// the fields spotify sends when no fields= parameter is given, pretty-printed
+// the way its API does. Names carry escapes, \u escapes and raw UTF-8 so the
+// string paths of the parsers get exercised too.
+
+static char const *const marketArray[] = {
+    "AD", "AE", "AG", "AL", "AM", "AO", "AR", "AT", "AU", "AZ", "BA", "BB",
+    "BD", "BE", "BF", "BG", "BH", "BI", "BJ", "BN", "BO", "BR", "BS", "BT",
+    "BW", "BY", "BZ", "CA", "CD", "CG", "CH", "CI", "CL", "CM", "CO", "CR",
+    "CV", "CW", "CY", "CZ", "DE", "DJ", "DK", "DM", "DO", "DZ", "EC", "EE",
+    "EG", "ES", "ET", "FI", "FJ", "FM", "FR", "GA", "GB", "GD", "GE", "GH",
+    "GM", "GN", "GQ", "GR", "GT", "GW", "GY", "HK", "HN", "HR", "HT", "HU",
+    "ID", "IE", "IL", "IN", "IQ", "IS", "IT", "JM",
+};
+
+static void __attribute__((format(printf, 2, 3)))
+appendFormat(MemoryArena *arena, char const *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int count = vsnprintf(0, 0, format, args);
+    va_end(args);
+    // vsnprintf always writes the '\0', which is popped right after
+    char *text = (char*)pushToMemoryArena(arena, count + 1);
+    va_start(args, format);
+    vsnprintf(text, count + 1, format, args);
+    va_end(args);
+    popFromMemoryArena(arena, 1);
+}
+
+static void
+appendMarkets(MemoryArena *arena, char const *indent)
+{
+    u64 marketCount = sizeof(marketArray)/sizeof(*marketArray);
+    appendFormat(arena, "\"available_markets\" : [ ");
+    for(u64 i = 0; i < marketCount; ++i) {
+        appendFormat(arena, "\"%s\"%s", marketArray[i],
+                (i + 1 < marketCount) ? ", " : " ],\n");
+    }
+    appendFormat(arena, "%s", indent);
+}
+
+static void
+appendArtist(MemoryArena *arena, unsigned long long index, b32 isLast)
+{
+    appendFormat(arena,
+            "{\n"
+            "          \"external_urls\" : {\n"
+            "            \"spotify\" : \"https://open.spotify.com/artist/"
+            "4Z8W4fKeB5YxbusRsdQVP%llu\"\n"
+            "          },\n"
+            "          \"href\" : \"https://api.spotify.com/v1/artists/"
+            "4Z8W4fKeB5YxbusRsdQVP%llu\",\n"
+            "          \"id\" : \"4Z8W4fKeB5YxbusRsdQVP%llu\",\n"
+            "          \"name\" : \"%s %llu\",\n"
+            "          \"type\" : \"artist\",\n"
+            "          \"uri\" : \"spotify:artist:4Z8W4fKeB5YxbusRsdQVP%llu\"\n"
+            "        }%s",
+            index % 10, index % 10, index % 10,
+            (index % 3) ? "Beyonc\\u00e9" : "Sigur R\xc3\xb3s", index,
+            index % 10, isLast ? "" : ", ");
+}
+
+static void
+appendTrackItem(MemoryArena *arena, unsigned long long index, b32 isLast)
+{
+    appendFormat(arena,
+            "{\n"
+            "    \"added_at\" : \"2023-06-%02lluT12:%02llu:%02lluZ\",\n"
+            "    \"added_by\" : {\n"
+            "      \"external_urls\" : {\n"
+            "        \"spotify\" : \"https://open.spotify.com/user/someone\"\n"
+            "      },\n"
+            "      \"href\" : \"https://api.spotify.com/v1/users/someone\",\n"
+            "      \"id\" : \"someone\",\n"
+            "      \"type\" : \"user\",\n"
+            "      \"uri\" : \"spotify:user:someone\"\n"
+            "    },\n"
+            "    \"is_local\" : false,\n"
+            "    \"primary_color\" : null,\n"
+            "    \"track\" : {\n"
+            "      \"album\" : {\n"
+            "        \"album_type\" : \"album\",\n"
+            "        \"artists\" : [ ",
+            index % 28 + 1, index % 60, (index * 7) % 60);
+    appendArtist(arena, index, 1);
+    appendFormat(arena, " ],\n        ");
+    appendMarkets(arena, "        ");
+    appendFormat(arena,
+            "\"external_urls\" : {\n"
+            "          \"spotify\" : \"https://open.spotify.com/album/"
+            "1ATL5GLyefJaxhQzSPVrL%llu\"\n"
+            "        },\n"
+            "        \"href\" : \"https://api.spotify.com/v1/albums/"
+            "1ATL5GLyefJaxhQzSPVrL%llu\",\n"
+            "        \"id\" : \"1ATL5GLyefJaxhQzSPVrL%llu\",\n"
+            "        \"images\" : [ ",
+            index % 10, index % 10, index % 10);
+    unsigned long long const imageSizeArray[] = {640, 300, 64};
+    for(unsigned long long i = 0; i < 3; ++i) {
+        appendFormat(arena,
+                "{\n"
+                "          \"height\" : %llu,\n"
+                "          \"url\" : \"https://i.scdn.co/image/"
+                "ab67616d0000b273%016llx\",\n"
+                "          \"width\" : %llu\n"
+                "        }%s",
+                imageSizeArray[i], index * 3 + i, imageSizeArray[i],
+                (i < 2) ? ", " : " ],\n");
+    }
+    appendFormat(arena,
+            "        \"name\" : \"Album %llu: \\\"Live\\\" \\/ Remastered\",\n"
+            "        \"release_date\" : \"19%02llu-01-01\",\n"
+            "        \"release_date_precision\" : \"day\",\n"
+            "        \"total_tracks\" : %llu,\n"
+            "        \"type\" : \"album\",\n"
+            "        \"uri\" : \"spotify:album:1ATL5GLyefJaxhQzSPVrL%llu\"\n"
+            "      },\n"
+            "      \"artists\" : [ ",
+            index, index % 100, index % 20 + 1, index % 10);
+    unsigned long long artistCount = index % 3 + 1;
+    for(unsigned long long i = 0; i < artistCount; ++i) {
+        appendArtist(arena, index + i, i + 1 == artistCount);
+    }
+    appendFormat(arena, " ],\n      ");
+    appendMarkets(arena, "      ");
+    appendFormat(arena,
+            "\"disc_number\" : 1,\n"
+            "      \"duration_ms\" : %llu,\n"
+            "      \"episode\" : false,\n"
+            "      \"explicit\" : %s,\n"
+            "      \"external_ids\" : {\n"
+            "        \"isrc\" : \"USUM7%07llu\"\n"
+            "      },\n"
+            "      \"external_urls\" : {\n"
+            "        \"spotify\" : \"https://open.spotify.com/track/"
+            "3n3Ppam7vgaVa1iaRUc9L%llu\"\n"
+            "      },\n"
+            "      \"href\" : \"https://api.spotify.com/v1/tracks/"
+            "3n3Ppam7vgaVa1iaRUc9L%llu\",\n"
+            "      \"id\" : \"3n3Ppam7vgaVa1iaRUc9L%llu\",\n"
+            "      \"is_local\" : false,\n"
+            "      \"name\" : \"Track %llu (feat. \\\"Someone\\\") \\u2013 "
+            "\xe6\x97\xa5\xe6\x9c\xac\",\n"
+            "      \"popularity\" : %llu,\n"
+            "      \"preview_url\" : null,\n"
+            "      \"track\" : true,\n"
+            "      \"track_number\" : %llu,\n"
+            "      \"type\" : \"track\",\n"
+            "      \"uri\" : \"spotify:track:3n3Ppam7vgaVa1iaRUc9L%llu\"\n"
+            "    },\n"
+            "    \"video_thumbnail\" : {\n"
+            "      \"url\" : null\n"
+            "    }\n"
+            "  }%s",
+            120000 + index * 997 % 240000, (index % 5) ? "false" : "true",
+            index, index % 10, index % 10, index % 10, index, index % 101,
+            index % 20 + 1, index % 10, isLast ? "" : ", ");
+}
+
+// Pushes a page with trackCount tracks onto arena and returns it, followed by
+// a '\0' that isn't part of the page
+static Buffer
+makeTrackPage(MemoryArena *arena, unsigned long long trackCount)
+{
+    Buffer page = {0};
+    page.data = pushToMemoryArena(arena, 0);
+    appendFormat(arena,
+            "{\n"
+            "  \"href\" : \"https://api.spotify.com/v1/playlists/"
+            "37i9dQZF1DXcBWIGoYBM5M/tracks?offset=0&limit=%llu\",\n"
+            "  \"items\" : [ ",
+            trackCount);
+    for(unsigned long long i = 0; i < trackCount; ++i) {
+        appendTrackItem(arena, i, i + 1 == trackCount);
+    }
+    appendFormat(arena,
+            " ],\n"
+            "  \"limit\" : %llu,\n"
+            "  \"next\" : null,\n"
+            "  \"offset\" : 0,\n"
+            "  \"previous\" : null,\n"
+            "  \"total\" : %llu\n"
+            "}\n",
+            trackCount, trackCount);
+    page.count = (u8*)pushToMemoryArena(arena, 0) - page.data;
+    pushToMemoryArena(arena, 1);
+    return page;
+}
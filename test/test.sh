@@ -0,0 +1,124 @@
+#!/bin/sh
+# Runs test/json_check.c, which compares the buffered and streaming JSON
+# parsers on the same documents. Then builds myspotifypl against
+# test/mock_api.py, a local stand-in for spotify that refuses requests with
+# 429 past a rate limit, and runs it twice in the same directory. The first run must count every refused request as
+# throttled and write the right CSVs. The second one must keep every file
+# from the manifest, except those of the playlists that share a name, which
+# must be downloaded again and left out of the manifest.
+#
+# usage: sh test/test.sh
+
+set -e
+
+compiler="${compiler-cc}"
+cflags="${cflags-}"
+port="${port-8899}"
+playlistCount="${playlistCount-60}"
+rateLimit="${rateLimit-50}"
+# playlists 0 to sharedNameCount have the same name
+sharedNameCount="${sharedNameCount-1}"
+# gzip, identity or none, see test/mock_api.py
+contentEncoding="${contentEncoding-gzip}"
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+work="$(mktemp -d)"
+server=""
+cleanUp() {
+    [ -n "$server" ] && kill "$server" 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanUp EXIT
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+$compiler -O3 $cflags -I"$root" -I"$root/src" \
+    -o "$work/json_check" "$root/test/json_check.c"
+# the documents that must be rejected print their parsing errors, and what
+# it prints with json_printElement is only checked for completeness
+"$work/json_check" > /dev/null 2> "$work/log" || {
+    grep -v "^JSON ERROR" "$work/log"
+    fail "the JSON parsers disagree"
+}
+
+origin="\"http://127.0.0.1:$port\""
+$compiler -O3 $cflags -I"$root" -I"$root/src" \
+    -DACCOUNTS_ORIGIN="$origin" -DAPI_ORIGIN="$origin" \
+    -o "$work/myspotifypl" "$root/src/main.c" -lcurl
+
+python3 "$root/test/mock_api.py" --port "$port" \
+    --playlists "$playlistCount" --rate-limit "$rateLimit" \
+    --shared-name-count "$sharedNameCount" \
+    --content-encoding "$contentEncoding" --expected "$work/expected" &
+server=$!
+while [ ! -f "$work/expected/.ready" ]; do
+    kill -0 "$server" || exit 1
+    sleep 0.1
+done
+
+# runs myspotifypl in $work/out, its output goes to $work/log
+runMyspotifypl() {
+    (cd "$work/out" && "$work/myspotifypl" authorization-code) \
+        2> "$work/log" || {
+        cat "$work/log"
+        fail "myspotifypl exited with an error"
+    }
+    grep "requests in\|compressed\|peak RSS" "$work/log"
+}
+
+# the files of playlists that share a name may hold either of them
+checkCsvs() {
+    excludes=""
+    while read -r name; do
+        excludes="$excludes -x '$name'"
+    done < "$work/expected/.shared"
+    eval diff -r -x "'.*'" -x myspotifypl-manifest.json $excludes \
+        '"$work/expected"' '"$work/out"' ||
+        fail "the CSVs differ from the expected ones"
+}
+
+mkdir "$work/out"
+runMyspotifypl
+throttled="$(sed -n 's/.*, \([0-9]*\) throttled$/\1/p' "$work/log")"
+peakRss="$(sed -n 's/^peak RSS //p' "$work/log")"
+responseCount="$(sed -n 's/.* of \([0-9]*\) responses compressed.*/\1/p' \
+    "$work/log")"
+compressedCount="$(sed -n 's/.*, \([0-9]*\) of [0-9]* responses compressed.*/\1/p' \
+    "$work/log")"
+# the mock doesn't compress its 429 responses
+if [ "$contentEncoding" = gzip ]; then
+    [ "$compressedCount" -gt 0 ] ||
+        fail "none of $responseCount gzipped responses counted as compressed"
+else
+    [ "$compressedCount" = 0 ] ||
+        fail "$compressedCount uncompressed responses counted as compressed"
+fi
+refused="$(cat "$work/expected/.throttled" 2>/dev/null || echo 0)"
+[ "$refused" -ne 0 ] ||
+    fail "the stand-in didn't refuse any request, lower rateLimit"
+[ "$throttled" = "$refused" ] ||
+    fail "$refused requests were refused, $throttled counted"
+checkCsvs
+
+sharedCount=0
+[ "$sharedNameCount" -gt 0 ] && sharedCount=$((sharedNameCount + 1))
+runMyspotifypl
+keptCount="$(grep -c "hasn't changed" "$work/log" || true)"
+readCount="$(grep -c "^reading playlist" "$work/log" || true)"
+[ "$keptCount" -eq $((playlistCount - sharedCount)) ] ||
+    fail "$keptCount playlists were kept on the second run"
+[ "$readCount" -eq "$sharedCount" ] ||
+    fail "$readCount playlists were downloaded on the second run"
+for i in $(seq 0 "$sharedNameCount"); do
+    [ "$sharedCount" -eq 0 ] && break
+    ! grep -q "\"pl$i\"" "$work/out/myspotifypl-manifest.json" ||
+        fail "playlist pl$i shares its file but is in the manifest"
+done
+checkCsvs
+
+echo "OK: $playlistCount playlists, $throttled requests throttled," \
+    "peak RSS $peakRss, $keptCount kept and $readCount downloaded again on" \
+    "the second run"
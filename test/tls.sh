@@ -0,0 +1,92 @@
+#!/bin/sh
+# Puts test/mock_api.py behind nghttpx, which terminates TLS with a
+# self-signed certificate, and downloads the library through it twice: once
+# with nghttpx offering HTTP/2 and once with HTTP/1.1 only. For each run it
+# reports the connections and TLS handshakes nghttpx saw, from its access
+# log, and myspotifypl's own count of new connections and time to first byte.
+#
+# usage: sh test/tls.sh
+
+set -e
+
+compiler="${compiler-cc}"
+cflags="${cflags-}"
+port="${port-8899}"
+tlsPort="${tlsPort-8900}"
+playlistCount="${playlistCount-200}"
+
+command -v nghttpx > /dev/null || {
+    echo "FAIL: nghttpx (from nghttp2) is needed"
+    exit 1
+}
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+work="$(mktemp -d)"
+server=""
+proxy=""
+cleanUp() {
+    [ -n "$proxy" ] && kill "$proxy" 2>/dev/null
+    [ -n "$server" ] && kill "$server" 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanUp EXIT
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+    -days 1 -subj "/CN=127.0.0.1" -addext "subjectAltName=IP:127.0.0.1" \
+    -keyout "$work/key.pem" -out "$work/cert.pem" 2> /dev/null
+
+origin="\"https://127.0.0.1:$tlsPort\""
+$compiler -O3 $cflags -I"$root" -I"$root/src" \
+    -DACCOUNTS_ORIGIN="$origin" -DAPI_ORIGIN="$origin" \
+    -DCA_CERTIFICATE_PATH="\"$work/cert.pem\"" \
+    -o "$work/myspotifypl" "$root/src/main.c" -lcurl
+
+python3 "$root/test/mock_api.py" --port "$port" \
+    --playlists "$playlistCount" --expected "$work/expected" &
+server=$!
+while [ ! -f "$work/expected/.ready" ]; do
+    kill -0 "$server" || exit 1
+    sleep 0.1
+done
+
+for protocols in h2 http/1.1; do
+    rm -f "$work/access.log"
+    nghttpx --frontend="127.0.0.1,$tlsPort" --backend="127.0.0.1,$port" \
+        --npn-list="$protocols" --no-ocsp --workers=1 \
+        --accesslog-file="$work/access.log" \
+        --accesslog-format='$remote_port $tls_session_reused $alpn' \
+        --errorlog-file="$work/error.log" \
+        "$work/key.pem" "$work/cert.pem" &
+    proxy=$!
+    sleep 1
+    kill -0 "$proxy" || fail "nghttpx didn't start, see $work/error.log"
+
+    rm -rf "$work/out"
+    mkdir "$work/out"
+    (cd "$work/out" && "$work/myspotifypl" authorization-code) \
+        2> "$work/log" || {
+        cat "$work/log"
+        fail "myspotifypl exited with an error"
+    }
+    kill "$proxy"
+    wait "$proxy" 2>/dev/null || true
+    proxy=""
+    diff -r -x '.*' -x myspotifypl-manifest.json \
+        "$work/expected" "$work/out" > /dev/null ||
+        fail "the CSVs differ from the expected ones"
+
+    # one line per request, the client port tells connections apart
+    connectionCount="$(cut -d' ' -f1 "$work/access.log" | sort -u | wc -l)"
+    resumedCount="$(grep ' r ' "$work/access.log" | cut -d' ' -f1 |
+        sort -u | wc -l)"
+    echo "$protocols: $(wc -l < "$work/access.log") requests," \
+        "$connectionCount connections," \
+        "$((connectionCount - resumedCount)) full TLS handshakes," \
+        "$resumedCount resumed"
+    grep "requests in\|new connections" "$work/log"
+done